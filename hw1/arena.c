@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	/** Offset of the last allocation. */
+	size_t last;
+	_Alignas(16) char data[];
+};
+
+static size_t
+arena_align(size_t size)
+{
+	return (size + 15) & ~(size_t)15;
+}
+
+void
+arena_create(struct arena *a, size_t chunk_size)
+{
+	memset(a, 0, sizeof(*a));
+	a->chunk_size = chunk_size;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	size = arena_align(size);
+	struct arena_chunk *c = a->head;
+	if (c == NULL || c->size - c->used < size) {
+		size_t chunk_size = size > a->chunk_size ? size : a->chunk_size;
+		c = malloc(sizeof(*c) + chunk_size);
+		c->next = a->head;
+		c->size = chunk_size;
+		c->used = 0;
+		a->head = c;
+		++a->chunk_count;
+		a->chunk_bytes += chunk_size;
+	}
+	c->last = c->used;
+	c->used += size;
+	++a->alloc_count;
+	return c->data + c->last;
+}
+
+void *
+arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+	struct arena_chunk *c = a->head;
+	bool is_last = c != NULL && (char *)ptr == c->data + c->last;
+	if (is_last && c->size - c->last >= arena_align(new_size)) {
+		c->used = c->last + arena_align(new_size);
+		return ptr;
+	}
+	if (new_size <= old_size)
+		return ptr;
+	void *res = arena_alloc(a, new_size);
+	memcpy(res, ptr, old_size);
+	++a->realloc_count;
+	a->bytes_copied += old_size;
+	return res;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	while (a->head != NULL) {
+		struct arena_chunk *c = a->head;
+		a->head = c->next;
+		free(c);
+	}
+}
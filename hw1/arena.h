@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/**
+ * Bump allocator. Memory is taken from big chunks and is released
+ * all at once by arena_destroy(). The last allocation can be resized
+ * in place, any other resize copies the data.
+ */
+struct arena {
+	/** The current chunk, others are linked behind it. */
+	struct arena_chunk *head;
+	/** Minimal chunk size. */
+	size_t chunk_size;
+	/** Number of allocations. */
+	long long alloc_count;
+	/** Number of chunks and their total size. */
+	long long chunk_count;
+	size_t chunk_bytes;
+	/** Number of resizes which had to move the data. */
+	long long realloc_count;
+	/** Bytes copied by such resizes. */
+	size_t bytes_copied;
+};
+
+void
+arena_create(struct arena *a, size_t chunk_size);
+
+/** Allocate size bytes aligned by 16. */
+void *
+arena_alloc(struct arena *a, size_t size);
+
+/**
+ * Resize an allocation. In place, if it is the last one and the chunk
+ * has enough space. Shrinking never moves the data.
+ */
+void *
+arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t new_size);
+
+/** Free all the chunks. */
+void
+arena_destroy(struct arena *a);
@@ -0,0 +1,111 @@
+import argparse
+import csv
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+parser = argparse.ArgumentParser(description = "Run the sorter over a matrix "\
+					       "of inputs and settings")
+parser.add_argument('--dists', type=str, default='uniform,sorted,reversed,zipf,few-unique,organ-pipe',
+		    help='comma separated distributions, see ./gen')
+parser.add_argument('--files', type=str, default='1,6', help='file counts')
+parser.add_argument('--sizes', type=str, default='10000,100000',
+		    help='number counts per file')
+parser.add_argument('--coros', type=str, default='1,4', help='coroutine counts')
+parser.add_argument('--latency', type=str, default='100,1000',
+		    help='target latencies T, us')
+parser.add_argument('--threads', type=str, default='1', help='merge thread counts')
+parser.add_argument('-m', type=int, default=1000000, help='maximal number')
+parser.add_argument('--repeat', type=int, default=1, help='runs of each point')
+parser.add_argument('--dir', type=str, default='bench_data',
+		    help='directory for generated files')
+parser.add_argument('--csv', type=str, default='bench.csv', help='CSV result file')
+parser.add_argument('--json', type=str, default='bench.json', help='JSON result file')
+parser.add_argument('--verify', action='store_true', default=False,
+		    help='check every output with ./verify')
+args = parser.parse_args()
+
+def int_list(s):
+	return [int(v) for v in s.split(',')]
+
+dists = args.dists.split(',')
+file_counts = int_list(args.files)
+sizes = int_list(args.sizes)
+coro_counts = int_list(args.coros)
+latencies = int_list(args.latency)
+thread_counts = int_list(args.threads)
+
+# Files are generated once and reused by all the points and later runs.
+def input_files(dist, size, count):
+	os.makedirs(args.dir, exist_ok=True)
+	files = []
+	for i in range(count):
+		name = os.path.join(args.dir, '{}_{}_{}_{}.txt'.format(dist, size, args.m, i))
+		if not os.path.exists(name):
+			subprocess.run(['./gen', '-f', name, '-c', str(size), '-m', str(args.m),
+					'-d', dist, '-s', str(i + 1)], check=True)
+		files.append(name)
+	return files
+
+patterns = {
+	'total_us': (r'total time: (\d+) us', [1]),
+	'missed': (r'latency: target \d+ us, missed (\d+) of (\d+), max wait (\d+) us', [1, 2, 3]),
+	'reallocs': (r'memory: .*, (\d+) reallocs, (\d+) bytes copied', [1, 2]),
+}
+fields = {
+	'total_us': ['total_us'],
+	'missed': ['missed', 'waits', 'max_wait_us'],
+	'reallocs': ['reallocs', 'bytes_copied'],
+}
+
+def parse_output(out):
+	res = {}
+	for key, (pattern, groups) in patterns.items():
+		m = re.search(pattern, out)
+		for name, group in zip(fields[key], groups):
+			res[name] = int(m.group(group)) if m else None
+	return res
+
+rows = []
+points = [(d, s, f, c, t, p) for d in dists for s in sizes for f in file_counts
+	  for c in coro_counts for t in latencies for p in thread_counts]
+for i, (dist, size, file_count, coros, latency, threads) in enumerate(points):
+	files = input_files(dist, size, file_count)
+	for run in range(args.repeat):
+		start = time.monotonic()
+		res = subprocess.run(['./main', '-p', str(threads), str(latency), str(coros)] + files,
+				     capture_output=True, text=True)
+		wall_us = int((time.monotonic() - start) * 1000000)
+		row = {
+			'dist': dist, 'size': size, 'files': file_count, 'coros': coros,
+			'latency_us': latency, 'threads': threads, 'run': run,
+			'exit_code': res.returncode, 'wall_us': wall_us,
+		}
+		row.update(parse_output(res.stdout))
+		if args.verify:
+			check = subprocess.run(['./verify', 'out.txt'] + files,
+					       capture_output=True, text=True)
+			row['verified'] = check.returncode == 0
+		rows.append(row)
+		print('[{}/{}] {}'.format(i + 1, len(points), ' '.join(
+			'{}={}'.format(k, v) for k, v in row.items())))
+
+columns = []
+for row in rows:
+	for k in row:
+		if k not in columns:
+			columns.append(k)
+with open(args.csv, 'w', newline='') as f:
+	writer = csv.DictWriter(f, fieldnames=columns)
+	writer.writeheader()
+	writer.writerows(rows)
+with open(args.json, 'w') as f:
+	json.dump({'m': args.m, 'results': rows}, f, indent=1)
+
+failed = [r for r in rows if r['exit_code'] != 0 or r.get('verified') is False]
+if failed:
+	print('{} runs failed'.format(len(failed)))
+	sys.exit(1)
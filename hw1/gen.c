@@ -0,0 +1,250 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "keys.h"
+
+// Generates a file of non-negative numbers in [0, max] separated by
+// spaces, like generator.py, but with different distributions and at
+// the disk speed: numbers are printed by hand into a big buffer which
+// is written with write().
+
+enum distribution {
+	DIST_UNIFORM,
+	DIST_SORTED,
+	DIST_REVERSED,
+	DIST_ZIPF,
+	DIST_FEW_UNIQUE,
+	DIST_ORGAN_PIPE,
+};
+
+static const char *dist_names[] = {
+	[DIST_UNIFORM] = "uniform",
+	[DIST_SORTED] = "sorted",
+	[DIST_REVERSED] = "reversed",
+	[DIST_ZIPF] = "zipf",
+	[DIST_FEW_UNIQUE] = "few-unique",
+	[DIST_ORGAN_PIPE] = "organ-pipe",
+};
+
+#define DIST_COUNT (sizeof(dist_names) / sizeof(dist_names[0]))
+
+// splitmix64 generator
+struct rng {
+	uint64_t state;
+};
+
+static uint64_t rng_next(struct rng *r) {
+	r->state += 0x9e3779b97f4a7c15ULL;
+	return hash_mix(r->state);
+}
+
+// uniform in [0, n), n > 0
+static uint64_t rng_below(struct rng *r, uint64_t n) {
+	return rng_next(r) % n;
+}
+
+// uniform in [0, 1)
+static double rng_double(struct rng *r) {
+	return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+// Zipf distribution over [1, n] by rejection-inversion
+// (W. Hormann, G. Derflinger, 1996), O(1) per value for any n
+struct zipf {
+	double exponent;
+	double n;
+	double h_integral_x1;
+	double h_integral_n;
+	double s;
+};
+
+static double zipf_helper1(double x) {
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x) {
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double zipf_h(const struct zipf *z, double x) {
+	return exp(-z->exponent * log(x));
+}
+
+static double zipf_h_integral(const struct zipf *z, double x) {
+	double log_x = log(x);
+	return zipf_helper2((1 - z->exponent) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const struct zipf *z, double x) {
+	double t = x * (1 - z->exponent);
+	if (t < -1)
+		t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_create(struct zipf *z, double n, double exponent) {
+	z->exponent = exponent;
+	z->n = n;
+	z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1;
+	z->h_integral_n = zipf_h_integral(z, n + 0.5);
+	z->s = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+static uint64_t zipf_next(const struct zipf *z, struct rng *r) {
+	while (true) {
+		double u = z->h_integral_n + rng_double(r) * (z->h_integral_x1 - z->h_integral_n);
+		double x = zipf_h_integral_inverse(z, u);
+		double k = floor(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+		if (k - x <= z->s || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+			return (uint64_t)k;
+	}
+}
+
+struct gen_params {
+	enum distribution dist;
+	uint64_t count;
+	uint64_t max;
+	uint64_t unique; // number of distinct values for few-unique
+	double exponent; // exponent for zipf
+};
+
+// i-th of count values in ascending order, evenly covering [0, max]
+static uint64_t ascending(uint64_t i, uint64_t count, uint64_t max) {
+	if (count < 2)
+		return 0;
+	return (uint64_t)((double)max * i / (count - 1));
+}
+
+static int generate(int fd, const struct gen_params *p, struct rng *r) {
+	struct zipf z;
+	if (p->dist == DIST_ZIPF)
+		zipf_create(&z, (double)p->max + 1, p->exponent);
+	uint64_t half = (p->count + 1) / 2;
+	const size_t buf_size = 1 << 20;
+	char *buf = malloc(buf_size);
+	size_t used = 0;
+	for (uint64_t i = 0; i < p->count; ++i) {
+		uint64_t v = 0;
+		switch (p->dist) {
+		case DIST_UNIFORM:
+			v = rng_below(r, p->max + 1);
+			break;
+		case DIST_SORTED:
+			v = ascending(i, p->count, p->max);
+			break;
+		case DIST_REVERSED:
+			v = ascending(p->count - 1 - i, p->count, p->max);
+			break;
+		case DIST_ZIPF:
+			v = zipf_next(&z, r) - 1;
+			break;
+		case DIST_FEW_UNIQUE:
+			v = ascending(rng_below(r, p->unique), p->unique, p->max);
+			break;
+		case DIST_ORGAN_PIPE:
+			v = ascending(i < half ? i : p->count - 1 - i, half, p->max);
+			break;
+		}
+		if (used + 21 > buf_size) {
+			if (write(fd, buf, used) != (ssize_t)used) {
+				free(buf);
+				return -1;
+			}
+			used = 0;
+		}
+		if (i != 0)
+			buf[used++] = ' ';
+		used += print_digits(buf + used, v);
+	}
+	int rc = write(fd, buf, used) == (ssize_t)used ? 0 : -1;
+	free(buf);
+	return rc;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Generate numbers file. Use the next format:\n");
+	fprintf(stderr, "%s -f file -c count [-m max] [-d distribution] [-u unique] "
+		"[-z exponent] [-s seed]\n", prog);
+	fprintf(stderr, "max - maximal number, 2^31 - 1 by default\n");
+	fprintf(stderr, "distribution - uniform (default), sorted, reversed, zipf, "
+		"few-unique, organ-pipe\n");
+	fprintf(stderr, "unique - distinct values for few-unique, 16 by default\n");
+	fprintf(stderr, "exponent - exponent for zipf, 1.0 by default\n");
+}
+
+int main(int argc, char **argv) {
+	const char *file = NULL;
+	struct gen_params p = {
+		.dist = DIST_UNIFORM,
+		.count = 0,
+		// the range is inclusive, so the default fits the int key type
+		.max = INT32_MAX,
+		.unique = 16,
+		.exponent = 1.0,
+	};
+	struct rng r = {(uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32)};
+	bool has_count = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:c:m:d:u:z:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'c':
+			p.count = strtoull(optarg, NULL, 10);
+			has_count = true;
+			break;
+		case 'm':
+			p.max = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			p.dist = DIST_COUNT;
+			for (size_t i = 0; i < DIST_COUNT; ++i) {
+				if (strcmp(dist_names[i], optarg) == 0)
+					p.dist = i;
+			}
+			if (p.dist == DIST_COUNT) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'u':
+			p.unique = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			p.exponent = atof(optarg);
+			break;
+		case 's':
+			r.state = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (file == NULL || !has_count || p.unique == 0 || p.exponent <= 0 ||
+	    p.max == UINT64_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s\n", file);
+		return 1;
+	}
+	int rc = generate(fd, &p, &r);
+	close(fd);
+	if (rc != 0) {
+		fprintf(stderr, "Can't write %s\n", file);
+		return 1;
+	}
+	return 0;
+}
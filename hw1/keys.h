@@ -0,0 +1,214 @@
+#pragma once
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Key types known to the sorter and their parse/print/compare
+ * primitives. Everything is static inline, so each kernel generated
+ * by sort_impl.h gets its own copy inlined into the hot loops.
+ */
+
+/** (key, payload) record. Written as "key:payload" in the files. */
+struct kv_record {
+	int64_t key;
+	int64_t payload;
+};
+
+/** Skip whitespaces between numbers. */
+static inline const char *
+parse_skip_space(const char *pos, const char *end)
+{
+	while (pos < end && (*pos == ' ' || *pos == '\n' ||
+			     *pos == '\t' || *pos == '\r'))
+		++pos;
+	return pos;
+}
+
+/** Parse decimal digits. NULL, if there is no digit at pos. */
+static inline const char *
+parse_digits(const char *pos, const char *end, uint64_t *out)
+{
+	if (pos == end || (unsigned)(*pos - '0') > 9)
+		return NULL;
+	uint64_t v = 0;
+	do {
+		v = v * 10 + (*pos - '0');
+		++pos;
+	} while (pos < end && (unsigned)(*pos - '0') <= 9);
+	*out = v;
+	return pos;
+}
+
+/** Parse a signed decimal without skipping leading whitespaces. */
+static inline const char *
+parse_signed(const char *pos, const char *end, int64_t *out)
+{
+	bool neg = false;
+	if (pos < end && (*pos == '-' || *pos == '+')) {
+		neg = *pos == '-';
+		++pos;
+	}
+	uint64_t v;
+	pos = parse_digits(pos, end, &v);
+	if (pos != NULL)
+		*out = neg ? (int64_t)(0 - v) : (int64_t)v;
+	return pos;
+}
+
+/**
+ * Returned by the parsers for a number out of the type's range. Like
+ * MAP_FAILED it is neither NULL nor a position in the data.
+ */
+#define PARSE_OUT_OF_RANGE ((const char *)-1)
+
+/**
+ * Per-type parsers. Each skips leading whitespaces, parses one value
+ * and returns the position right after it. NULL means there is no
+ * more values (end of data or garbage, same as fscanf() stops). A value
+ * out of the type's range is not wrapped into it, PARSE_OUT_OF_RANGE
+ * is returned instead.
+ */
+static inline const char *
+parse_int(const char *pos, const char *end, int *out)
+{
+	int64_t v;
+	pos = parse_signed(parse_skip_space(pos, end), end, &v);
+	if (pos == NULL)
+		return NULL;
+	if (v < INT_MIN || v > INT_MAX)
+		return PARSE_OUT_OF_RANGE;
+	*out = (int)v;
+	return pos;
+}
+
+static inline const char *
+parse_int64(const char *pos, const char *end, int64_t *out)
+{
+	return parse_signed(parse_skip_space(pos, end), end, out);
+}
+
+static inline const char *
+parse_uint32(const char *pos, const char *end, uint32_t *out)
+{
+	uint64_t v;
+	pos = parse_digits(parse_skip_space(pos, end), end, &v);
+	if (pos == NULL)
+		return NULL;
+	if (v > UINT32_MAX)
+		return PARSE_OUT_OF_RANGE;
+	*out = (uint32_t)v;
+	return pos;
+}
+
+static inline const char *
+parse_uint64(const char *pos, const char *end, uint64_t *out)
+{
+	return parse_digits(parse_skip_space(pos, end), end, out);
+}
+
+static inline const char *
+parse_kv(const char *pos, const char *end, struct kv_record *out)
+{
+	pos = parse_signed(parse_skip_space(pos, end), end, &out->key);
+	if (pos == NULL || pos == end || *pos != ':')
+		return NULL;
+	return parse_signed(pos + 1, end, &out->payload);
+}
+
+/**
+ * Print an unsigned decimal into buf, which must have at least 20
+ * bytes. Returns the printed length.
+ */
+static inline int
+print_digits(char *buf, uint64_t v)
+{
+	char tmp[20];
+	int len = 0;
+	do {
+		tmp[len++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	for (int i = 0; i < len; ++i)
+		buf[i] = tmp[len - 1 - i];
+	return len;
+}
+
+static inline int
+print_signed(char *buf, int64_t v)
+{
+	if (v >= 0)
+		return print_digits(buf, v);
+	buf[0] = '-';
+	return 1 + print_digits(buf + 1, 0 - (uint64_t)v);
+}
+
+/** Longest printed value, "key:payload" with both signs. */
+#define KEY_PRINT_MAX 48
+
+/** Per-type printers, the same format the parsers accept. */
+static inline int
+print_int(char *buf, int v)
+{
+	return print_signed(buf, v);
+}
+
+static inline int
+print_int64(char *buf, int64_t v)
+{
+	return print_signed(buf, v);
+}
+
+static inline int
+print_uint32(char *buf, uint32_t v)
+{
+	return print_digits(buf, v);
+}
+
+static inline int
+print_uint64(char *buf, uint64_t v)
+{
+	return print_digits(buf, v);
+}
+
+static inline int
+print_kv(char *buf, struct kv_record v)
+{
+	int len = print_signed(buf, v.key);
+	buf[len++] = ':';
+	return len + print_signed(buf + len, v.payload);
+}
+
+/**
+ * 64 bit mixer (splitmix64 finalizer). Sums of mixed values are order
+ * independent hashes of multisets.
+ */
+static inline uint64_t
+hash_mix(uint64_t v)
+{
+	v ^= v >> 30;
+	v *= 0xbf58476d1ce4e5b9ULL;
+	v ^= v >> 27;
+	v *= 0x94d049bb133111ebULL;
+	v ^= v >> 31;
+	return v;
+}
+
+/** Per-type hashes. Scalars are hashed as 64 bit values. */
+#define key_hash_scalar(v) hash_mix((uint64_t)(v))
+
+static inline uint64_t
+key_hash_kv(struct kv_record v)
+{
+	return hash_mix((uint64_t)v.key ^ hash_mix((uint64_t)v.payload));
+}
+
+/** Per-type strict "less" orders. */
+#define key_less_scalar(a, b) ((a) < (b))
+
+static inline bool
+key_less_kv(struct kv_record a, struct kv_record b)
+{
+	return a.key < b.key || (a.key == b.key && a.payload < b.payload);
+}
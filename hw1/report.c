@@ -0,0 +1,99 @@
+#include <sys/resource.h>
+#include "arena.h"
+#include "report.h"
+#include "sched.h"
+
+static const char *phase_names[] = {
+	[PHASE_READ] = "read",
+	[PHASE_PARSE] = "parse",
+	[PHASE_SORT] = "sort",
+	[PHASE_MERGE] = "merge",
+	[PHASE_WRITE] = "write",
+};
+
+static void
+json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void
+json_phases(FILE *out, const long long *phases)
+{
+	fprintf(out, "{");
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		fprintf(out, "%s\"%s\": %lld", i == 0 ? "" : ", ",
+			phase_names[i], phases[i] / 1000);
+	}
+	fprintf(out, "}");
+}
+
+void
+report_write(FILE *out, const struct run_report *r)
+{
+	/* Coroutine phases are summed, merge and write are done by main. */
+	long long phases[PHASE_COUNT] = {0};
+	for (int i = 0; i < r->coro_count; ++i) {
+		for (int j = 0; j < PHASE_COUNT; ++j)
+			phases[j] += r->coros[i].phases[j];
+	}
+	phases[PHASE_MERGE] += r->merge;
+	phases[PHASE_WRITE] += r->write;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"type\": ");
+	json_string(out, r->type);
+	fprintf(out, ",\n  \"target_us\": %lld,\n", r->sched->target / 1000);
+	fprintf(out, "  \"merge_threads\": %d,\n", r->thread_count);
+	fprintf(out, "  \"runs\": %d,\n", r->run_count);
+	fprintf(out, "  \"total_us\": %lld,\n", r->total / 1000);
+	fprintf(out, "  \"phases_us\": ");
+	json_phases(out, phases);
+	fprintf(out, ",\n  \"latency\": {\"waits\": %lld, \"missed\": %lld, "
+		"\"max_wait_us\": %lld},\n", r->sched->waits, r->sched->misses,
+		r->sched->max_wait / 1000);
+	fprintf(out, "  \"memory\": {\"peak_rss_kb\": %ld, "
+		"\"allocations\": %lld, \"chunks\": %lld, \"chunk_bytes\": %zu, "
+		"\"reallocs\": %lld, \"bytes_copied\": %zu},\n",
+		usage.ru_maxrss, r->arena->alloc_count, r->arena->chunk_count,
+		r->arena->chunk_bytes, r->arena->realloc_count,
+		r->arena->bytes_copied);
+
+	fprintf(out, "  \"files\": [");
+	for (int i = 0; i < r->file_count; ++i) {
+		const struct file_report *f = &r->files[i];
+		fprintf(out, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+		json_string(out, f->name);
+		fprintf(out, ", \"bytes\": %zu, \"values\": %zu}", f->bytes,
+			f->values);
+	}
+	fprintf(out, "\n  ],\n");
+
+	fprintf(out, "  \"coroutines\": [");
+	for (int i = 0; i < r->coro_count; ++i) {
+		const struct coro_report *c = &r->coros[i];
+		fprintf(out, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+		json_string(out, c->name);
+		fprintf(out, ", \"switches\": %lld, \"worked_us\": %lld, "
+			"\"cpu_us\": %lld, \"waits\": %lld, \"missed\": %lld, "
+			"\"max_wait_us\": %lld, \"phases_us\": ", c->switches,
+			c->worked / 1000, c->cpu / 1000, c->waits, c->misses,
+			c->max_wait / 1000);
+		json_phases(out, c->phases);
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct arena;
+struct latency_sched;
+
+/** Phases of the sort, their time is measured separately. */
+enum phase {
+	PHASE_READ,
+	PHASE_PARSE,
+	PHASE_SORT,
+	PHASE_MERGE,
+	PHASE_WRITE,
+	PHASE_COUNT,
+};
+
+/** Statistics of one input file. */
+struct file_report {
+	const char *name;
+	size_t bytes;
+	/** Parsed values. */
+	size_t values;
+};
+
+/** Statistics of one sorting coroutine. */
+struct coro_report {
+	char name[16];
+	long long switches;
+	/** Monotonic time while running, ns. */
+	long long worked;
+	/** Thread CPU time while running, ns. */
+	long long cpu;
+	long long waits;
+	long long misses;
+	long long max_wait;
+	/** Running time by phases, ns. */
+	long long phases[PHASE_COUNT];
+};
+
+/** Statistics of the whole run. */
+struct run_report {
+	const char *type;
+	int thread_count;
+	int run_count;
+	long long total;
+	/** Merge and write time of main, ns. */
+	long long merge;
+	long long write;
+	int file_count;
+	const struct file_report *files;
+	int coro_count;
+	const struct coro_report *coros;
+	const struct latency_sched *sched;
+	const struct arena *arena;
+};
+
+/** Print the report as JSON. */
+void
+report_write(FILE *out, const struct run_report *r);
@@ -0,0 +1,130 @@
+#include <time.h>
+#include "libcoro.h"
+#include "sched.h"
+
+/** Weight of a new sample in the running averages is 1/8. */
+static long long
+ewma(long long avg, long long sample)
+{
+	return avg + (sample - avg) / 8;
+}
+
+void
+latency_sched_create(struct latency_sched *sched, long long target)
+{
+	sched->target = target;
+	sched->workers = 0;
+	sched->blocked = 0;
+	sched->reserve = 0;
+	sched->margins = 0;
+	sched->waits = 0;
+	sched->misses = 0;
+	sched->max_wait = 0;
+}
+
+long long
+sched_now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+void
+sched_slot_create(struct sched_slot *slot, struct latency_sched *sched,
+		  bool is_interactive)
+{
+	slot->sched = sched;
+	slot->is_interactive = is_interactive;
+	slot->slice_start = 0;
+	slot->last_check = 0;
+	slot->step = 0;
+	slot->margin = 0;
+	slot->cost = 0;
+	slot->waits = 0;
+	slot->misses = 0;
+	slot->max_wait = 0;
+	if (!is_interactive)
+		++sched->workers;
+}
+
+void
+sched_slot_start(struct sched_slot *slot)
+{
+	slot->slice_start = sched_now();
+	slot->last_check = slot->slice_start;
+}
+
+long long
+sched_slice(const struct latency_sched *sched)
+{
+	if (sched->workers == 0)
+		return sched->target;
+	/*
+	 * A worker yields at the checkpoint after its slice and then does
+	 * its bookkeeping, so how late it has been is taken off the round
+	 * first.
+	 */
+	long long rest = sched->target - sched->reserve - sched->margins;
+	if (rest < 0)
+		rest = 0;
+	int runnable = sched->workers - sched->blocked;
+	return rest / (runnable > 0 ? runnable : 1);
+}
+
+bool
+sched_slot_should_yield(struct sched_slot *slot)
+{
+	long long now = sched_now();
+	slot->step = ewma(slot->step, now - slot->last_check);
+	slot->last_check = now;
+	long long budget = sched_slice(slot->sched) - slot->step;
+	return now - slot->slice_start >= budget;
+}
+
+void
+sched_slot_yield(struct sched_slot *slot)
+{
+	struct latency_sched *sched = slot->sched;
+	long long yield_at = sched_now();
+	if (slot->is_interactive) {
+		long long cost = ewma(slot->cost, yield_at - slot->slice_start);
+		sched->reserve += cost - slot->cost;
+		slot->cost = cost;
+	} else {
+		/* A new peak is taken at once, it goes away slowly. */
+		long long late = yield_at - slot->slice_start - sched_slice(sched);
+		if (late < 0)
+			late = 0;
+		long long margin = late > slot->margin ? late : ewma(slot->margin, late);
+		sched->margins += margin - slot->margin;
+		slot->margin = margin;
+	}
+	coro_yield();
+	long long now = sched_now();
+	long long wait = now - yield_at;
+	++slot->waits;
+	++sched->waits;
+	if (wait > sched->target) {
+		++slot->misses;
+		++sched->misses;
+	}
+	if (wait > slot->max_wait)
+		slot->max_wait = wait;
+	if (wait > sched->max_wait)
+		sched->max_wait = wait;
+	slot->slice_start = now;
+	slot->last_check = now;
+}
+
+void
+sched_slot_finish(struct sched_slot *slot)
+{
+	struct latency_sched *sched = slot->sched;
+	if (slot->is_interactive)
+		sched->reserve -= slot->cost;
+	else {
+		--sched->workers;
+		sched->margins -= slot->margin;
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Target latency scheduler. The target latency T is divided between
+ * the workers which are runnable right now, so when some of them are
+ * done the others get longer slices. Each slice is shortened by the
+ * observed time between the worker's checkpoints, so a worker yields
+ * before overrunning its slice, not after.
+ *
+ * Interactive tenants yield right after a short piece of work. Their
+ * observed run time and the margin of each worker, how late it has
+ * yielded after its slice, are reserved from T, so a round of all the
+ * runnable coroutines fits into T. Workers waiting for input do not
+ * get slices.
+ */
+struct latency_sched {
+	/** Target latency, ns. */
+	long long target;
+	/** Number of not finished workers. */
+	int workers;
+	/** Number of workers waiting for input. */
+	int blocked;
+	/** Sum of interactive tenants run times, ns. */
+	long long reserve;
+	/** Sum of the workers' margins, ns. */
+	long long margins;
+	/** Number of measured waits. */
+	long long waits;
+	/** Number of waits longer than the target. */
+	long long misses;
+	/** The longest measured wait, ns. */
+	long long max_wait;
+};
+
+/** Scheduling state of one coroutine. */
+struct sched_slot {
+	struct latency_sched *sched;
+	bool is_interactive;
+	/** When the current slice has started, ns. */
+	long long slice_start;
+	/** Last checkpoint time, ns. */
+	long long last_check;
+	/** Average time between two checkpoints, ns. */
+	long long step;
+	/** How late a worker yields after its slice, ns. */
+	long long margin;
+	/** Average run time of an interactive tenant, ns. */
+	long long cost;
+	/** Wait statistics of this coroutine. */
+	long long waits;
+	long long misses;
+	long long max_wait;
+};
+
+void
+latency_sched_create(struct latency_sched *sched, long long target);
+
+/** Monotonic time, ns. */
+long long
+sched_now(void);
+
+/**
+ * Register a coroutine in the scheduler. Workers are counted as
+ * runnable right away, even if not started yet.
+ */
+void
+sched_slot_create(struct sched_slot *slot, struct latency_sched *sched,
+		  bool is_interactive);
+
+/** Called by the coroutine when it starts running. */
+void
+sched_slot_start(struct sched_slot *slot);
+
+/** Slice of a worker in the current state of the scheduler, ns. */
+long long
+sched_slice(const struct latency_sched *sched);
+
+/**
+ * Worker checkpoint. True, if the worker should yield now, because
+ * its next step would not fit into the rest of the slice.
+ */
+bool
+sched_slot_should_yield(struct sched_slot *slot);
+
+/** Yield and account the wait after getting back. */
+void
+sched_slot_yield(struct sched_slot *slot);
+
+/** Unregister the coroutine when it is done. */
+void
+sched_slot_finish(struct sched_slot *slot);
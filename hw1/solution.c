@@ -1,38 +1,83 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "keys.h"
 #include "libcoro.h"
+#include "report.h"
+#include "sched.h"
+#include "sort.h"
+
+// sorted runs to merge, shared for all coroutines
+struct run_list {
+	void **data; // arrays
+	size_t *size; // array sizes
+	int count;
+	int cap;
+	size_t max_run; // maximal run of a streamed input, values
+};
 
 struct my_context {
 	char *name; // coroutine name
 	char **file_list; // list of filenames
 	int file_count; // number of files
 	int *file_idx; // current file index (shared for all coroutines)
-	int **arr_p; // pointer to current array (to save allocated array adress)
-	int *arr; // current array
-	int *size_p; // pointer to array of array sizes
+	const struct key_ops *ops; // kernels of the key type
+	struct arena *arena; // arena for the arrays of this coroutine only
+	struct run_list *runs; // list to publish sorted arrays
+	void *arr; // current streamed run or selection
+	size_t arr_len; // values count in arr
+	size_t arr_cap; // capacity of arr
+	const struct key_select *sel; // selection instead of full sort, or NULL
 	int sec_start; 
 	int nsec_start;
 	int sec_finish;
 	int nsec_finish;
 	int sec_total;
 	int nsec_total;
-	int nsec_limit;
+	long long cpu_start; // thread CPU time at the start, ns
+	enum phase phase; // what the coroutine is doing now
+	long long phase_start; // when the current phase has started or resumed, ns
+	struct coro_report *report; // statistics of the coroutine for the run report
+	struct file_report *files; // statistics of the files, shared for all coroutines
+	struct file_report *file; // statistics of the current file
+	const char *out_of_range; // value out of the key type's range in the parsed text, or NULL
+	struct sched_slot slot; // time slice and latency accounting
+};
+
+struct probe_context {
+	char name[32]; // tenant name
+	struct sched_slot slot;
 };
 
 // allocates context object and initialize fields
 static struct my_context *my_context_new(const char *name, char **file_list, int file_count, 
-										 int *idx, int **data_p, int* size_p, int limit) {
-	struct my_context *ctx = malloc(sizeof(*ctx));
+										 int *idx, const struct key_ops *ops,
+										 struct arena *arena, struct run_list *runs,
+										 const struct key_select *sel, struct latency_sched *sched,
+										 struct coro_report *report, struct file_report *files) {
+	struct my_context *ctx = calloc(1, sizeof(*ctx));
 	ctx->name = strdup(name);
+	ctx->sel = sel;
 	ctx->file_list = file_list;
 	ctx->file_idx = idx;
 	ctx->file_count = file_count;
-	ctx->arr_p = data_p;
-	ctx->size_p = size_p;
-	ctx->nsec_limit = limit;
+	ctx->ops = ops;
+	ctx->arena = arena;
+	ctx->runs = runs;
+	ctx->report = report;
+	ctx->files = files;
+	snprintf(report->name, sizeof(report->name), "%s", name);
+	sched_slot_create(&ctx->slot, sched, false);
 	return ctx;
 }
 
@@ -43,6 +88,13 @@ static void my_context_delete(struct my_context *ctx)
 	free(ctx);
 }
 
+// CPU time of the thread in ns, it does not grow while the process is off the CPU
+static long long cpu_now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
 // update context finish time
 static void stop_timer(struct my_context *ctx) {
 	struct timespec time;
@@ -57,6 +109,7 @@ static void start_timer(struct my_context *ctx) {
 	clock_gettime(CLOCK_MONOTONIC, &time);
 	ctx->sec_start = time.tv_sec;
 	ctx->nsec_start = time.tv_nsec;
+	ctx->cpu_start = cpu_now();
 }
 
 // calculate total context time with nanoseconds overflow
@@ -68,124 +121,366 @@ static void calculate_time(struct my_context *ctx) {
 	} else {
 		ctx->nsec_total += ctx->nsec_finish - ctx->nsec_start;
 	}
+	ctx->report->cpu += cpu_now() - ctx->cpu_start;
+}
+
+// accounts the time of the current phase and switches to the next one
+static void set_phase(struct my_context *ctx, enum phase phase) {
+	long long now = sched_now();
+	ctx->report->phases[ctx->phase] += now - ctx->phase_start;
+	ctx->phase = phase;
+	ctx->phase_start = now;
 }
 
-// checks if the runtime for the context is exceeded
-static bool is_exceed(struct my_context *ctx) {
+// yields with the timers stopped, the time of waiting is not accounted
+static void pause_coro(struct my_context *ctx) {
+	set_phase(ctx, ctx->phase);
 	stop_timer(ctx);
-	int current_quant = (ctx->sec_finish - ctx->sec_start) * 1000000000 + 
-						(ctx->nsec_finish - ctx->nsec_start);
-	return current_quant > ctx->nsec_limit ? true : false;
+	calculate_time(ctx);
+	sched_slot_yield(&ctx->slot);
+	start_timer(ctx);
+	ctx->phase_start = sched_now();
 }
 
-// swaps 2 int
-void swap(int *a, int *b) {
-	int t = *a;
-	*a = *b;
-	*b = t;
+// yields if the slice is over, called by the sort and parse kernels
+void sort_checkpoint(struct my_context *ctx) {
+	if (sched_slot_should_yield(&ctx->slot))
+		pause_coro(ctx);
 }
 
-// find the partition of array
-int partition(int *array, int left, int right) {
-	int pivot = array[right];
-	int i = (left - 1);
+// called by the parse kernels, the caller of the kernel reports it
+void sort_out_of_range(struct my_context *ctx, const char *pos) {
+	ctx->out_of_range = pos;
+}
+
+// the value out of range fails the run, like a file which can't be opened,
+// the output would miss the rest of the file
+static void report_out_of_range(struct my_context *ctx, size_t offset) {
+	fprintf(stderr, "%s: value out of range at offset %zu\n", ctx->file->name, offset);
+}
 
-	for (int j = left; j < right; j++) {
-		if (array[j] <= pivot) {
-			i++;
-			swap(&array[i], &array[j]);
+// yields because the input has no data yet
+// if all the workers wait for input, sleeps in ppoll for up to the target latency
+static void wait_input(struct my_context *ctx, int fd) {
+	struct latency_sched *sched = ctx->slot.sched;
+	if (++sched->blocked == sched->workers) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		struct timespec timeout = {
+			.tv_sec = sched->target / 1000000000,
+			.tv_nsec = sched->target % 1000000000,
+		};
+		ppoll(&pfd, 1, &timeout, NULL);
+	}
+	pause_coro(ctx);
+	--sched->blocked;
+}
+
+// reads up to cap bytes, yields while a non-blocking input has no data
+// returns 0 on end of file or error
+static size_t read_chunk(struct my_context *ctx, int fd, char *buf, size_t cap) {
+	while (true) {
+		ssize_t rc = read(fd, buf, cap);
+		if (rc >= 0) {
+			ctx->file->bytes += rc;
+			return rc;
 		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			wait_input(ctx, fd);
+		else if (errno != EINTR)
+			return 0;
 	}
-	swap(&array[i + 1], &array[right]);
-	return (i + 1);
 }
 
-// quicksort implementation with coroutine yields every iteration
-void quick_sort(int *array, int left, int right, struct my_context *ctx) {
-	if (left < right) {
-		int pi = partition(array, left, right);
-		quick_sort(array, left, pi - 1, ctx);
-		quick_sort(array, pi + 1, right, ctx);
+// read the whole regular file into a malloc'ed buffer by 64KB chunks
+// with a checkpoint after each chunk
+// the buffer is sized from fstat, it grows only if the file grows meanwhile
+static char *read_file(int fd, size_t file_size, size_t *len, struct my_context *ctx) {
+	const size_t chunk = 64 * 1024;
+	size_t size = 0;
+	size_t cap = file_size + 1;
+	char *buf = malloc(cap);
+	size_t rc;
+	while ((rc = read_chunk(ctx, fd, buf + size, cap - size < chunk ? cap - size : chunk)) > 0) {
+		size += rc;
+		if (size == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			ctx->arena->realloc_count++;
+			ctx->arena->bytes_copied += size;
+		}
+		sort_checkpoint(ctx);
+	}
+	*len = size;
+	return buf;
+}
 
-		if (is_exceed(ctx)) {
-			stop_timer(ctx);
-			calculate_time(ctx);
-			coro_yield();
-			start_timer(ctx);
+// estimate how many values the text has, from bytes per value in its first 4KB
+static size_t estimate_count(const char *text, size_t len) {
+	size_t sample = len < 4096 ? len : 4096;
+	size_t tokens = 0;
+	for (size_t i = 0; i < sample; ++i) {
+		if (parse_skip_space(text + i, text + i + 1) == text + i &&
+			(i == 0 || parse_skip_space(text + i - 1, text + i) != text + i - 1))
+			tokens++;
+	}
+	if (tokens == 0)
+		return 16;
+	return len / sample * tokens + len % sample * tokens / sample + 16;
+}
+
+// parse the text into an arena array sized by the estimate with 1/8 more
+// if the estimate is still too low, the array grows by the observed bytes
+// per value
+// returns NULL and prints the error if a value is out of range
+static void *parse_file(struct my_context *ctx, const char *text, size_t len, size_t *count) {
+	const struct key_ops *ops = ctx->ops;
+	const char *pos = text;
+	const char *end = text + len;
+	size_t cap = estimate_count(text, len);
+	cap += cap / 8;
+	void *arr = arena_alloc(ctx->arena, cap * ops->size);
+	size_t size = 0;
+	while (true) {
+		size += ops->parse(&pos, end, (char *)arr + size * ops->size, cap - size, ctx);
+		if (ctx->out_of_range != NULL) {
+			report_out_of_range(ctx, ctx->out_of_range - text);
+			return NULL;
+		}
+		if (size < cap || parse_skip_space(pos, end) == end)
+			break;
+		size_t done = pos - text;
+		size_t new_cap = cap + (end - pos) * size / done * 9 / 8 + 16;
+		arr = arena_realloc(ctx->arena, arr, cap * ops->size, new_cap * ops->size);
+		cap = new_cap;
+	}
+	// shrink to fit, free of charge as the arena is of this coroutine only,
+	// the next file of the coroutine takes the rest of the chunk
+	arr = arena_realloc(ctx->arena, arr, cap * ops->size, size * ops->size);
+	ctx->file->values += size;
+	*count = size;
+	return arr;
+}
+
+// adds a sorted array to the runs to merge
+static void run_list_push(struct run_list *runs, void *data, size_t size) {
+	if (runs->count == runs->cap) {
+		runs->cap = (runs->cap + 1) * 2;
+		runs->data = realloc(runs->data, runs->cap * sizeof(*runs->data));
+		runs->size = realloc(runs->size, runs->cap * sizeof(*runs->size));
+	}
+	runs->data[runs->count] = data;
+	runs->size[runs->count] = size;
+	runs->count++;
+}
+
+// starts a new streamed run or selection array of cap values
+static void start_arr(struct my_context *ctx, size_t cap) {
+	ctx->arr_cap = cap;
+	ctx->arr_len = 0;
+	ctx->arr = arena_alloc(ctx->arena, cap * ctx->ops->size);
+}
+
+// sorts the current streamed run or selection and publishes it
+static void finish_arr(struct my_context *ctx) {
+	enum phase phase = ctx->phase;
+	set_phase(ctx, PHASE_SORT);
+	ctx->ops->sort(ctx->arr, ctx->arr_len, ctx);
+	run_list_push(ctx->runs, ctx->arr, ctx->arr_len);
+	ctx->arr = NULL;
+	set_phase(ctx, phase);
+}
+
+// parses complete values of a chunk into the selection or the current run
+// a run which reaches the maximal size is sorted and published
+// returns false on garbage, it stops the file like in the full sort, and
+// on a value out of range
+static bool consume_chunk(struct my_context *ctx, const char *pos, const char *end) {
+	const struct key_ops *ops = ctx->ops;
+	const size_t max_run = ctx->runs->max_run;
+	while (true) {
+		if (ctx->sel != NULL) {
+			ctx->arr_len = ops->select(&pos, end, ctx->arr, ctx->arr_len,
+									   ctx->arr_cap, ctx->sel, &ctx->file->values, ctx);
+		} else {
+			size_t count = ops->parse(&pos, end, (char *)ctx->arr + ctx->arr_len * ops->size,
+									  ctx->arr_cap - ctx->arr_len, ctx);
+			ctx->arr_len += count;
+			ctx->file->values += count;
 		}
+		if (ctx->out_of_range != NULL)
+			return false;
+		if (parse_skip_space(pos, end) == end)
+			return true;
+		if (ctx->arr_len < ctx->arr_cap || (ctx->sel != NULL && ctx->sel->top != 0))
+			return false;
+		if (ctx->sel == NULL && ctx->arr_cap >= max_run) {
+			finish_arr(ctx);
+			start_arr(ctx, max_run < 65536 ? max_run : 65536);
+			continue;
+		}
+		size_t cap = 2 * ctx->arr_cap;
+		if (ctx->sel == NULL && cap > max_run)
+			cap = max_run;
+		ctx->arr = arena_realloc(ctx->arena, ctx->arr, ctx->arr_cap * ops->size,
+								 cap * ops->size);
+		ctx->arr_cap = cap;
 	}
 }
 
+// streams the input by 64KB chunks as the data arrives, so pipes and
+// sockets are sorted without being read till the end first
+// only the text of one chunk is buffered
+// returns false and prints the error if a value is out of range
+static bool stream_file(struct my_context *ctx, int fd) {
+	if (ctx->sel == NULL)
+		start_arr(ctx, ctx->runs->max_run < 65536 ? ctx->runs->max_run : 65536);
+	char buf[64 * 1024];
+	size_t used = 0;
+	size_t offset = 0; // of the chunk in the file
+	bool is_eof = false;
+	while (!is_eof) {
+		set_phase(ctx, PHASE_READ);
+		size_t rc = read_chunk(ctx, fd, buf + used, sizeof(buf) - used);
+		used += rc;
+		is_eof = rc == 0;
+		// the last value can continue in the next chunk
+		const char *end = buf + used;
+		if (!is_eof) {
+			while (end > buf && parse_skip_space(end - 1, end) == end - 1)
+				--end;
+			if (end == buf && used == sizeof(buf))
+				end = buf + used;
+		}
+		set_phase(ctx, PHASE_PARSE);
+		if (!consume_chunk(ctx, buf, end)) {
+			if (ctx->out_of_range == NULL)
+				break;
+			report_out_of_range(ctx, offset + (ctx->out_of_range - buf));
+			return false;
+		}
+		memmove(buf, end, buf + used - end);
+		used -= end - buf;
+		offset += end - buf;
+		sort_checkpoint(ctx);
+	}
+	if (ctx->sel == NULL)
+		finish_arr(ctx);
+	return true;
+}
+
+// opens the input non-blocking, "-" is stdin
+static int open_input(const char *filename, int *stdin_flags) {
+	if (strcmp(filename, "-") != 0)
+		return open(filename, O_RDONLY | O_NONBLOCK);
+	*stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+	fcntl(STDIN_FILENO, F_SETFL, *stdin_flags | O_NONBLOCK);
+	return STDIN_FILENO;
+}
+
+// closes the input, stdin gets its flags back
+static void close_input(int fd, int stdin_flags) {
+	if (fd == STDIN_FILENO)
+		fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+	else
+		close(fd);
+}
+
+// ends the coroutine with the status which fails the whole run
+static int fail_coro(struct my_context *ctx) {
+	sched_slot_finish(&ctx->slot);
+	my_context_delete(ctx);
+	return 1;
+}
+
 // coroutine function
 static int coroutine_func_f(void *context) {
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
 	start_timer(ctx);
+	ctx->phase = PHASE_READ;
+	ctx->phase_start = sched_now();
+	sched_slot_start(&ctx->slot);
+
+	// with selection all the files of the coroutine are reduced into one array
+	if (ctx->sel != NULL)
+		start_arr(ctx, ctx->sel->top != 0 ? ctx->sel->top : 1024);
 
 	while (*ctx->file_idx != ctx->file_count) {
-		char *filename = ctx->file_list[*ctx->file_idx];
-		FILE *in = fopen(filename, "r");
-		if (!in) {
-			my_context_delete(ctx);
-			return 1;
+		// takes the file before parsing, because parsing can yield
+		int idx = (*ctx->file_idx)++;
+		char *filename = ctx->file_list[idx];
+		ctx->file = &ctx->files[idx];
+		set_phase(ctx, PHASE_READ);
+		int stdin_flags = 0;
+		int fd = open_input(filename, &stdin_flags);
+		if (fd < 0) {
+			// the status fails the whole run, its output would miss the file
+			fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+			return fail_coro(ctx);
 		}
-		int size = 0;
-		int cap = 100;
-		ctx->arr = malloc(cap * sizeof(int));
-		
-		// read data from textfile
-		// reallocate the array if capacity has run out
-		while (fscanf(in, "%d", ctx->arr + size) == 1) {
-			++size;
-			if (size == cap) {
-				cap *= 2;
-				ctx->arr = realloc(ctx->arr, cap * sizeof(int));
-			}
+		struct stat st;
+		if (ctx->sel != NULL || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			// selection, pipes and sockets are consumed as the data arrives
+			bool is_ok = stream_file(ctx, fd);
+			close_input(fd, stdin_flags);
+			if (!is_ok)
+				return fail_coro(ctx);
+			continue;
 		}
-
-		// shrink to fit
-		cap = size;
-		ctx->arr = realloc(ctx->arr, cap * sizeof(int));
-
-		fclose(in);
-
-		// returns the address of allocated array, size
-		ctx->arr_p[*ctx->file_idx] = ctx->arr; 
-		ctx->size_p[*ctx->file_idx] = size;
-
-		// changes current file index to the next file
-		(*ctx->file_idx)++;
-		
-		quick_sort(ctx->arr, 0, size - 1, ctx);
+		// read data from textfile and parse it with the type kernel
+		size_t len;
+		char *text = read_file(fd, st.st_size, &len, ctx);
+		close_input(fd, stdin_flags);
+		set_phase(ctx, PHASE_PARSE);
+		size_t size;
+		void *arr = parse_file(ctx, text, len, &size);
+		free(text);
+		if (arr == NULL)
+			return fail_coro(ctx);
+
+		set_phase(ctx, PHASE_SORT);
+		ctx->ops->sort(arr, size, ctx);
+		run_list_push(ctx->runs, arr, size);
 	}
 
+	if (ctx->sel != NULL)
+		finish_arr(ctx);
+
+	set_phase(ctx, ctx->phase);
 	stop_timer(ctx);
 	calculate_time(ctx);
-
-	printf("%s info:\nswitch count %lld\nworked %d us\n\n",
+	sched_slot_finish(&ctx->slot);
+	ctx->report->switches = coro_switch_count(this);
+	ctx->report->worked = ctx->sec_total * 1000000000LL + ctx->nsec_total;
+	ctx->report->waits = ctx->slot.waits;
+	ctx->report->misses = ctx->slot.misses;
+	ctx->report->max_wait = ctx->slot.max_wait;
+
+	printf("%s info:\nswitch count %lld\nworked %d us\nmissed %lld of %lld, max wait %lld us\n\n",
 	 	ctx->name,
 	    coro_switch_count(this),
-		ctx->sec_total * 1000000 + ctx->nsec_total / 1000
+		ctx->sec_total * 1000000 + ctx->nsec_total / 1000,
+		ctx->slot.misses, ctx->slot.waits, ctx->slot.max_wait / 1000
 	);
 
 	my_context_delete(ctx);
 	return 0;
 }
 
-// merge cnt sorted arrays
-// returns index of array with minimum current value
-// data - arrays, size - array sizes, idx - current indexes, cnt - arrays count
-// O(cnt*N), N - maximum size of arrays
-int merge(int **data, int *size, int *idx, int cnt) {
-	int min_idx = -1;
-	int curr_min = INT_MAX;
-	for (int i = 0; i < cnt; ++i) {
-		if ((size[i] > idx[i]) && (data[i][idx[i]] < curr_min)) {
-			curr_min = data[i][idx[i]];
-			min_idx = i;
-		}
+// interactive tenant: does a tiny piece of work and yields while the workers run
+static int probe_func_f(void *context) {
+	struct probe_context *ctx = context;
+	sched_slot_start(&ctx->slot);
+	while (ctx->slot.sched->workers > 0) {
+		sched_slot_yield(&ctx->slot);
 	}
-	return min_idx;
+	sched_slot_finish(&ctx->slot);
+
+	printf("%s info:\nmissed %lld of %lld, max wait %lld us\n\n",
+		ctx->name, ctx->slot.misses, ctx->slot.waits, ctx->slot.max_wait / 1000);
+
+	free(ctx);
+	return 0;
 }
 
 int main(int argc, char **argv) {
@@ -194,52 +489,142 @@ int main(int argc, char **argv) {
 	
 	coro_sched_init();
 
+	const char *prog = argv[0];
+	const struct key_ops *ops = key_ops_find("int");
+	int probe_count = 0;
+	int thread_count = 1;
+	size_t max_run = 1 << 20;
+	struct key_select sel = {0};
+	const char *range = NULL;
+	const char *report_file = NULL;
+	static const struct option long_options[] = {
+		{"top", required_argument, NULL, 'k'},
+		{"range", required_argument, NULL, 'r'},
+		{"run-size", required_argument, NULL, 'R'},
+		{"report", required_argument, NULL, 'j'},
+		{NULL, 0, NULL, 0},
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "t:i:p:", long_options, NULL)) != -1) {
+		if (opt == 't' && (ops = key_ops_find(optarg)) != NULL)
+			continue;
+		if (opt == 'i' && (probe_count = atoi(optarg)) >= 0)
+			continue;
+		if (opt == 'p' && (thread_count = atoi(optarg)) > 0)
+			continue;
+		if (opt == 'k' && (sel.top = strtoull(optarg, NULL, 10)) > 0)
+			continue;
+		if (opt == 'r') {
+			range = optarg;
+			continue;
+		}
+		if (opt == 'R' && (max_run = strtoull(optarg, NULL, 10)) > 0)
+			continue;
+		if (opt == 'j') {
+			report_file = optarg;
+			continue;
+		}
+		ops = NULL;
+		break;
+	}
+	if (ops != NULL && range != NULL && !ops->parse_range(range, &sel))
+		ops = NULL;
+	bool is_select = sel.top != 0 || sel.has_range;
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	int file_count = argc - 3;
-	int coroutine_count = atoi(argv[2]);
+	int coroutine_count = argc > 2 ? atoi(argv[2]) : 0;
 
-	if(!coroutine_count || !file_count) {
+	if(!ops || !coroutine_count || file_count <= 0) {
 		fprintf(stderr, "Invalid command line arguments. Use the next format:\n");
-		fprintf(stderr, "%s T N {files list}\n", argv[0]);
+		fprintf(stderr, "%s [-t type] [-i I] [-p P] [--top K] [--range lo:hi] [--run-size R] [--report FILE] T N {files list}\n", prog);
 		fprintf(stderr, "T - target latency, N - coroutines count\n");
+		fprintf(stderr, "I - interactive tenants count, P - merge threads count\n");
+		fprintf(stderr, "type - key type: %s (default int)\n", key_ops_names());
+		fprintf(stderr, "K - output only K smallest values, lo:hi - only values within [lo, hi]\n");
+		fprintf(stderr, "R - maximal sorted run of a pipe or socket, values\n");
+		fprintf(stderr, "FILE - where to write the run report as JSON\n");
+		fprintf(stderr, "\"-\" in files list is stdin\n");
 		return 1;
 	}
 
-	int *p[file_count]; // array of pointers to arrays
-	int s[file_count]; // array of sizes
+	// sorted runs: one per regular file, runs of streamed inputs,
+	// or one per coroutine with selection
+	struct run_list runs = {.max_run = max_run};
 	int file_idx = 0;
+	// all the arrays, freed after the merge, an arena per coroutine, so the
+	// array a coroutine parses is always the last allocation of its arena
+	// and grows and shrinks in place
+	struct arena *arenas = calloc(coroutine_count, sizeof(*arenas));
+	for (int i = 0; i < coroutine_count; ++i)
+		arena_create(&arenas[i], 1024 * 1024);
+	struct latency_sched sched;
+	latency_sched_create(&sched, atoll(argv[1]) * 1000);
+	// statistics for the run report, filled by the coroutines
+	struct coro_report *coro_reports = calloc(coroutine_count, sizeof(*coro_reports));
+	struct file_report *file_reports = calloc(file_count, sizeof(*file_reports));
+	for (int i = 0; i < file_count; ++i)
+		file_reports[i].name = argv[3 + i];
 
 	for (int i = 0; i < coroutine_count; ++i) {
 		char name[16];
 		sprintf(name, "coro_%d", i);
 		coro_new(coroutine_func_f, 
-				 my_context_new(name, argv + 3, file_count, &file_idx, p, s, 
-				 atoi(argv[1]) * 1000 / file_count));
+				 my_context_new(name, argv + 3, file_count, &file_idx, ops, &arenas[i], &runs, 
+				 is_select ? &sel : NULL, &sched, &coro_reports[i], file_reports));
+	}
+	for (int i = 0; i < probe_count; ++i) {
+		struct probe_context *probe = malloc(sizeof(*probe));
+		sprintf(probe->name, "probe_%d", i);
+		sched_slot_create(&probe->slot, &sched, true);
+		coro_new(probe_func_f, probe);
 	}
 	struct coro *c;
+	bool is_failed = false;
 	while ((c = coro_sched_wait()) != NULL) {
+		is_failed = is_failed || coro_status(c) != 0;
 		coro_delete(c);
 	}
-
-	int idx[file_count]; // array of current indexes for merging arrays
-	for (int i = 0; i < file_count; ++i) {
-		idx[i] = 0;
+	if (is_failed) {
+		free(runs.data);
+		free(runs.size);
+		for (int i = 0; i < coroutine_count; ++i)
+			arena_destroy(&arenas[i]);
+		free(arenas);
+		free(coro_reports);
+		free(file_reports);
+		return 1;
 	}
 
-	FILE *out = fopen("out.txt", "w");
+	printf("latency: target %lld us, missed %lld of %lld, max wait %lld us\n",
+		sched.target / 1000, sched.misses, sched.waits, sched.max_wait / 1000);
 
-	int min_idx = 0;
-	while(min_idx != -1) {
-		min_idx = merge(p, s, idx, file_count);
-		if (min_idx != -1) {
-			fprintf(out, "%d ", p[min_idx][idx[min_idx]]);
-			idx[min_idx] += 1;
-		}
-	}
+	long long merge_start = sched_now();
+	long long write_ns = 0;
+	FILE *out = fopen("out.txt", "w");
+	ops->merge_write(runs.data, runs.size, runs.count, sel.top != 0 ? sel.top : SIZE_MAX,
+					 thread_count, out, &write_ns);
 	fclose(out);
+	long long merge_ns = sched_now() - merge_start - write_ns;
+	int run_count = runs.count;
+	free(runs.data);
+	free(runs.size);
 	
-	for (int i = 0; i < file_count; ++i) {
-		free(p[i]);
+	struct arena arena; // totals of the arenas for the report
+	arena_create(&arena, 0);
+	for (int i = 0; i < coroutine_count; ++i) {
+		arena.alloc_count += arenas[i].alloc_count;
+		arena.chunk_count += arenas[i].chunk_count;
+		arena.chunk_bytes += arenas[i].chunk_bytes;
+		arena.realloc_count += arenas[i].realloc_count;
+		arena.bytes_copied += arenas[i].bytes_copied;
+		arena_destroy(&arenas[i]);
 	}
+	free(arenas);
+	printf("memory: %lld allocations in %lld chunks of %zu bytes, %lld reallocs, %zu bytes copied\n",
+		arena.alloc_count, arena.chunk_count, arena.chunk_bytes,
+		arena.realloc_count, arena.bytes_copied);
 
 	struct timespec finish;
 	clock_gettime(CLOCK_MONOTONIC, &finish);
@@ -247,5 +632,32 @@ int main(int argc, char **argv) {
 	printf("total time: %ld us\n", 
 			(finish.tv_sec - start.tv_sec) * 1000000 + (finish.tv_nsec - start.tv_nsec) / 1000);
 
+	if (report_file != NULL) {
+		struct run_report report = {
+			.type = ops->name,
+			.thread_count = thread_count,
+			.run_count = run_count,
+			.total = (finish.tv_sec - start.tv_sec) * 1000000000LL +
+					 (finish.tv_nsec - start.tv_nsec),
+			.merge = merge_ns,
+			.write = write_ns,
+			.file_count = file_count,
+			.files = file_reports,
+			.coro_count = coroutine_count,
+			.coros = coro_reports,
+			.sched = &sched,
+			.arena = &arena,
+		};
+		FILE *f = fopen(report_file, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Can't open %s\n", report_file);
+		} else {
+			report_write(f, &report);
+			fclose(f);
+		}
+	}
+	free(coro_reports);
+	free(file_reports);
+
 	return 0;
 }
@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keys.h"
+#include "sched.h"
+#include "sort.h"
+
+/**
+ * One segment of a parallel merge, merged by its own thread, or by the
+ * caller if the thread can't be created.
+ */
+struct merge_task {
+	void **data;
+	const size_t *size;
+	int cnt;
+	/** Output ranks [rank_begin, rank_end) of the segment. */
+	size_t rank_begin;
+	size_t rank_end;
+	/** Preallocated output of the whole merge. */
+	void *out;
+	/** The segment printed as text. */
+	char *text;
+	size_t text_len;
+	/** The segment is merged by its own thread, not by the caller. */
+	bool is_thread;
+};
+
+#define KEY_NAME int
+#define KEY_T int
+#define KEY_LESS key_less_scalar
+#define KEY_PARSE parse_int
+#define KEY_PRINT print_int
+#include "sort_impl.h"
+
+#define KEY_NAME int64
+#define KEY_T int64_t
+#define KEY_LESS key_less_scalar
+#define KEY_PARSE parse_int64
+#define KEY_PRINT print_int64
+#include "sort_impl.h"
+
+#define KEY_NAME uint32
+#define KEY_T uint32_t
+#define KEY_LESS key_less_scalar
+#define KEY_PARSE parse_uint32
+#define KEY_PRINT print_uint32
+#include "sort_impl.h"
+
+#define KEY_NAME uint64
+#define KEY_T uint64_t
+#define KEY_LESS key_less_scalar
+#define KEY_PARSE parse_uint64
+#define KEY_PRINT print_uint64
+#include "sort_impl.h"
+
+#define KEY_NAME kv
+#define KEY_T struct kv_record
+#define KEY_LESS key_less_kv
+#define KEY_PARSE parse_kv
+#define KEY_PRINT print_kv
+#include "sort_impl.h"
+
+static const struct key_ops *const all_key_ops[] = {
+	&key_ops_int,
+	&key_ops_int64,
+	&key_ops_uint32,
+	&key_ops_uint64,
+	&key_ops_kv,
+};
+
+#define KEY_OPS_COUNT (sizeof(all_key_ops) / sizeof(all_key_ops[0]))
+
+const struct key_ops *
+key_ops_find(const char *name)
+{
+	for (size_t i = 0; i < KEY_OPS_COUNT; ++i) {
+		if (strcmp(all_key_ops[i]->name, name) == 0)
+			return all_key_ops[i];
+	}
+	return NULL;
+}
+
+const char *
+key_ops_names(void)
+{
+	return "int, int64, uint32, uint64, kv";
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct my_context;
+
+/**
+ * Selection of values instead of a full sort: the top smallest ones
+ * and/or the ones within [lo, hi].
+ */
+struct key_select {
+	/** How many smallest values to keep, 0 means all. */
+	size_t top;
+	bool has_range;
+	/** Range bounds, values of the key type. */
+	_Alignas(16) char lo[16];
+	_Alignas(16) char hi[16];
+};
+
+/**
+ * Sort kernels of one key type. The kernels are generated per type at
+ * compile time from sort_impl.h, so the only dispatch left is one
+ * indirect call per file or per merge, never per element.
+ */
+struct key_ops {
+	/** Name used by the command line flag. */
+	const char *name;
+	/** Element size in bytes. */
+	size_t size;
+	/**
+	 * Parse up to cap values from [*pos, end) into arr. Returns the
+	 * number of parsed values, *pos is moved right after the last
+	 * of them. Calls sort_checkpoint() on the way.
+	 */
+	size_t (*parse)(const char **pos, const char *end, void *arr,
+			size_t cap, struct my_context *ctx);
+	/**
+	 * Add the selected values from [*pos, end) to arr which has size
+	 * values already. With sel->top the array is a max-heap of top
+	 * capacity, otherwise parsing stops when it is full. Returns the
+	 * new size, *pos is moved right after the last parsed value,
+	 * *parsed is increased by the number of parsed values.
+	 */
+	size_t (*select)(const char **pos, const char *end, void *arr,
+			 size_t size, size_t cap, const struct key_select *sel,
+			 size_t *parsed, struct my_context *ctx);
+	/** Parse "lo:hi" range bounds into sel. False on bad format. */
+	bool (*parse_range)(const char *str, struct key_select *sel);
+	/** Sort the array, calling sort_checkpoint() on the way. */
+	void (*sort)(void *arr, size_t count, struct my_context *ctx);
+	/**
+	 * Merge cnt sorted arrays and print the first limit values of
+	 * the result into out. With more than one thread the output is
+	 * split into independent merge path segments, the result is the
+	 * same byte by byte. Time spent in writing is added to
+	 * *write_ns.
+	 */
+	void (*merge_write)(void **data, const size_t *size, int cnt,
+			    size_t limit, int threads, FILE *out,
+			    long long *write_ns);
+};
+
+/** Find the kernels by type name. NULL, if the type is unknown. */
+const struct key_ops *
+key_ops_find(const char *name);
+
+/** Names of all the types, for the usage message. */
+const char *
+key_ops_names(void);
+
+/**
+ * Called by the kernels after each sorting or parsing step. Defined by the
+ * user of the kernels, can yield the current coroutine.
+ */
+void
+sort_checkpoint(struct my_context *ctx);
+
+/**
+ * Called by the parse kernels when the value at pos is out of the key
+ * type's range. They stop right before it, as on garbage. Defined by
+ * the user of the kernels.
+ */
+void
+sort_out_of_range(struct my_context *ctx, const char *pos);
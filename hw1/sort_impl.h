@@ -0,0 +1,450 @@
+/*
+ * Sort, merge and parse kernels for one key type. Define before each
+ * inclusion:
+ *
+ *   KEY_NAME          - type name, suffix of the generated functions;
+ *   KEY_T             - element type;
+ *   KEY_LESS(a, b)    - strict order of two elements;
+ *   KEY_PARSE(p, e, v) - parse one element, see keys.h;
+ *   KEY_PRINT(buf, v) - print one element, see keys.h.
+ *
+ * Every inclusion generates an independent set of static functions
+ * and the key_ops_KEY_NAME table. The macros are undefined at the end.
+ * The including file provides struct merge_task and pthread.h.
+ */
+
+#define KEY_CAT_(a, b) a##_##b
+#define KEY_CAT(a, b) KEY_CAT_(a, b)
+#define KEY_FN(name) KEY_CAT(name, KEY_NAME)
+#define KEY_STR_(a) #a
+#define KEY_STR(a) KEY_STR_(a)
+
+static inline void
+KEY_FN(swap)(KEY_T *array, long i, long j)
+{
+	KEY_T t = array[i];
+	array[i] = array[j];
+	array[j] = t;
+}
+
+// three way partition around the median of the first, middle and last
+// values: [left, *lt) < pivot, [*lt, *gt] == pivot, (*gt, right] > pivot
+// long partitions have a checkpoint every 4096 elements
+static void
+KEY_FN(partition)(KEY_T *array, long left, long right, long *lt, long *gt,
+		  struct my_context *ctx)
+{
+	long mid = left + (right - left) / 2;
+	if (KEY_LESS(array[mid], array[left]))
+		KEY_FN(swap)(array, mid, left);
+	if (KEY_LESS(array[right], array[left]))
+		KEY_FN(swap)(array, right, left);
+	if (KEY_LESS(array[right], array[mid]))
+		KEY_FN(swap)(array, right, mid);
+	KEY_T pivot = array[mid];
+
+	long l = left, i = left, g = right;
+	for (long step = 1; i <= g; ++step) {
+		if ((step & 4095) == 0)
+			sort_checkpoint(ctx);
+		if (KEY_LESS(array[i], pivot))
+			KEY_FN(swap)(array, l++, i++);
+		else if (KEY_LESS(pivot, array[i]))
+			KEY_FN(swap)(array, i, g--);
+		else
+			i++;
+	}
+	*lt = l;
+	*gt = g;
+}
+
+// restore the heap property of the subtree at i
+static void
+KEY_FN(sift_down)(KEY_T *array, long i, long count)
+{
+	while (true) {
+		long child = 2 * i + 1;
+		if (child >= count)
+			return;
+		if (child + 1 < count && KEY_LESS(array[child], array[child + 1]))
+			child++;
+		if (!KEY_LESS(array[i], array[child]))
+			return;
+		KEY_FN(swap)(array, i, child);
+		i = child;
+	}
+}
+
+// heapsort with a checkpoint every 256 sifts, for unlucky pivots
+static void
+KEY_FN(heap_sort)(KEY_T *array, long count, struct my_context *ctx)
+{
+	for (long i = count / 2 - 1; i >= 0; --i) {
+		KEY_FN(sift_down)(array, i, count);
+		if ((i & 255) == 0)
+			sort_checkpoint(ctx);
+	}
+	for (long end = count - 1; end > 0; --end) {
+		KEY_FN(swap)(array, 0, end);
+		KEY_FN(sift_down)(array, 0, end);
+		if ((end & 255) == 0)
+			sort_checkpoint(ctx);
+	}
+}
+
+// quicksort implementation with a checkpoint every iteration
+// recurses into the smaller part and loops on the bigger one, so the
+// stack depth is O(log N); after depth_limit unbalanced partitions
+// the rest is sorted by heapsort
+static void
+KEY_FN(quick_sort)(KEY_T *array, long left, long right, int depth_limit,
+		   struct my_context *ctx)
+{
+	while (left < right) {
+		if (depth_limit-- == 0) {
+			KEY_FN(heap_sort)(array + left, right - left + 1, ctx);
+			return;
+		}
+		long lt, gt;
+		KEY_FN(partition)(array, left, right, &lt, &gt, ctx);
+		if (lt - left < right - gt) {
+			KEY_FN(quick_sort)(array, left, lt - 1, depth_limit, ctx);
+			left = gt + 1;
+		} else {
+			KEY_FN(quick_sort)(array, gt + 1, right, depth_limit, ctx);
+			right = lt - 1;
+		}
+		sort_checkpoint(ctx);
+	}
+}
+
+static void
+KEY_FN(sort)(void *arr, size_t count, struct my_context *ctx)
+{
+	int depth_limit = 0;
+	for (size_t n = count; n > 1; n /= 2)
+		depth_limit += 2;
+	KEY_FN(quick_sort)(arr, 0, (long)count - 1, depth_limit, ctx);
+}
+
+// move the last value of the heap up to its place
+static void
+KEY_FN(sift_up)(KEY_T *array, long i)
+{
+	while (i > 0) {
+		long parent = (i - 1) / 2;
+		if (!KEY_LESS(array[parent], array[i]))
+			return;
+		KEY_FN(swap)(array, i, parent);
+		i = parent;
+	}
+}
+
+_Static_assert(sizeof(KEY_T) <= sizeof(((struct key_select *)0)->lo),
+	       "range bounds do not fit the key type");
+
+// add the selected values to arr with a checkpoint every 1024 values
+// top selection keeps a max-heap of the smallest values in arr
+static size_t
+KEY_FN(select)(const char **pos, const char *end, void *arr, size_t size,
+	       size_t cap, const struct key_select *sel, size_t *parsed,
+	       struct my_context *ctx)
+{
+	KEY_T *out = arr;
+	const KEY_T *lo = (const KEY_T *)sel->lo;
+	const KEY_T *hi = (const KEY_T *)sel->hi;
+	const char *p = *pos;
+	const char *next = NULL;
+	KEY_T v;
+	size_t count = 0;
+	while ((sel->top != 0 || size < cap) &&
+	       (next = KEY_PARSE(p, end, &v)) != NULL &&
+	       next != PARSE_OUT_OF_RANGE) {
+		p = next;
+		if (++count % 1024 == 0)
+			sort_checkpoint(ctx);
+		if (sel->has_range && (KEY_LESS(v, *lo) || KEY_LESS(*hi, v)))
+			continue;
+		if (sel->top == 0) {
+			out[size++] = v;
+		} else if (size < sel->top) {
+			out[size] = v;
+			KEY_FN(sift_up)(out, size++);
+		} else if (KEY_LESS(v, out[0])) {
+			out[0] = v;
+			KEY_FN(sift_down)(out, 0, size);
+		}
+	}
+	if (next == PARSE_OUT_OF_RANGE)
+		sort_out_of_range(ctx, parse_skip_space(p, end));
+	*pos = p;
+	*parsed += count;
+	return size;
+}
+
+static bool
+KEY_FN(parse_range)(const char *str, struct key_select *sel)
+{
+	const char *end = str + strlen(str);
+	KEY_T lo, hi;
+	const char *pos = KEY_PARSE(str, end, &lo);
+	if (pos == NULL || pos == PARSE_OUT_OF_RANGE || pos == end ||
+	    *pos != ':')
+		return false;
+	pos = KEY_PARSE(pos + 1, end, &hi);
+	if (pos != end)
+		return false;
+	memcpy(sel->lo, &lo, sizeof(lo));
+	memcpy(sel->hi, &hi, sizeof(hi));
+	sel->has_range = true;
+	return true;
+}
+
+// parse up to cap values into arr with a checkpoint every 1024 values
+// *pos is moved right after the last parsed value
+static size_t
+KEY_FN(parse_array)(const char **pos, const char *end, void *arr, size_t cap,
+		    struct my_context *ctx)
+{
+	KEY_T *out = arr;
+	const char *p = *pos;
+	const char *next = NULL;
+	size_t size = 0;
+	while (size < cap && (next = KEY_PARSE(p, end, &out[size])) != NULL &&
+	       next != PARSE_OUT_OF_RANGE) {
+		p = next;
+		if (++size % 1024 == 0)
+			sort_checkpoint(ctx);
+	}
+	if (next == PARSE_OUT_OF_RANGE)
+		sort_out_of_range(ctx, parse_skip_space(p, end));
+	*pos = p;
+	return size;
+}
+
+// returns index of array with minimum current value, -1 if all are done
+// O(cnt) per call
+static int
+KEY_FN(merge)(KEY_T **data, const size_t *size, const size_t *idx, int cnt)
+{
+	int min_idx = -1;
+	for (int i = 0; i < cnt; ++i) {
+		if (size[i] > idx[i] && (min_idx == -1 ||
+		    KEY_LESS(data[i][idx[i]], data[min_idx][idx[min_idx]])))
+			min_idx = i;
+	}
+	return min_idx;
+}
+
+// number of elements of the sorted array which are less than v
+static size_t
+KEY_FN(lower_bound)(const KEY_T *arr, size_t size, KEY_T v)
+{
+	size_t lo = 0, hi = size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (KEY_LESS(arr[mid], v))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// number of elements of the sorted array which are not greater than v
+static size_t
+KEY_FN(upper_bound)(const KEY_T *arr, size_t size, KEY_T v)
+{
+	size_t lo = 0, hi = size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (!KEY_LESS(v, arr[mid]))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// merge path split: finds split[i] for each array, so the first rank
+// elements of the merged output are exactly data[i][0, split[i]).
+// Equal values are ordered by array index like merge() does, so the
+// segments merged separately concatenate into the sequential result.
+// hi and cnt_before are scratch arrays of cnt elements.
+static void
+KEY_FN(split)(KEY_T **data, const size_t *size, int cnt, size_t rank,
+	      size_t *split, size_t *hi, size_t *cnt_before)
+{
+	for (int i = 0; i < cnt; ++i) {
+		split[i] = 0;
+		hi[i] = size[i];
+	}
+	while (true) {
+		// pivot is the middle of the widest undecided range
+		int j = -1;
+		for (int i = 0; i < cnt; ++i) {
+			if (hi[i] > split[i] && (j == -1 ||
+			    hi[i] - split[i] > hi[j] - split[j]))
+				j = i;
+		}
+		if (j == -1)
+			return;
+		size_t m = split[j] + (hi[j] - split[j]) / 2;
+		KEY_T v = data[j][m];
+		size_t before = 0;
+		for (int i = 0; i < cnt; ++i) {
+			if (i < j)
+				cnt_before[i] = KEY_FN(upper_bound)(data[i], size[i], v);
+			else if (i == j)
+				cnt_before[i] = m;
+			else
+				cnt_before[i] = KEY_FN(lower_bound)(data[i], size[i], v);
+			before += cnt_before[i];
+		}
+		if (before < rank) {
+			// the pivot and everything before it are in the prefix
+			for (int i = 0; i < cnt; ++i) {
+				if (cnt_before[i] > split[i])
+					split[i] = cnt_before[i];
+			}
+			split[j] = m + 1;
+		} else {
+			// the pivot and everything after it are in the suffix
+			for (int i = 0; i < cnt; ++i) {
+				if (cnt_before[i] < hi[i])
+					hi[i] = cnt_before[i];
+			}
+		}
+	}
+}
+
+// print values separated by spaces into a growing buffer
+static void
+KEY_FN(format)(const KEY_T *arr, size_t count, char **text, size_t *len)
+{
+	size_t cap = count * 8 + KEY_PRINT_MAX + 1;
+	char *buf = malloc(cap);
+	size_t used = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (used + KEY_PRINT_MAX + 1 > cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+		used += KEY_PRINT(buf + used, arr[i]);
+		buf[used++] = ' ';
+	}
+	*text = buf;
+	*len = used;
+}
+
+// merge one segment of the output found by split() and format it
+static void *
+KEY_FN(merge_thread)(void *arg)
+{
+	struct merge_task *task = arg;
+	KEY_T **data = (KEY_T **)task->data;
+	int cnt = task->cnt;
+	size_t *idx = malloc(4 * cnt * sizeof(*idx));
+	size_t *end = idx + cnt;
+	size_t *scratch = end + cnt;
+	KEY_FN(split)(data, task->size, cnt, task->rank_begin, idx,
+		      scratch, scratch + cnt);
+	KEY_FN(split)(data, task->size, cnt, task->rank_end, end,
+		      scratch, scratch + cnt);
+
+	KEY_T *out = (KEY_T *)task->out + task->rank_begin;
+	size_t count = task->rank_end - task->rank_begin;
+	for (size_t k = 0; k < count; ++k) {
+		int min_idx = KEY_FN(merge)(data, end, idx, cnt);
+		out[k] = data[min_idx][idx[min_idx]++];
+	}
+	free(idx);
+	KEY_FN(format)(out, count, &task->text, &task->text_len);
+	return NULL;
+}
+
+// write the text and account the time to *write_ns
+static void
+KEY_FN(write)(const char *text, size_t len, FILE *out, long long *write_ns)
+{
+	long long start = sched_now();
+	fwrite(text, 1, len, out);
+	*write_ns += sched_now() - start;
+}
+
+// merge cnt sorted arrays and print the first limit values separated by spaces
+static void
+KEY_FN(merge_write)(void **data, const size_t *size, int cnt, size_t limit,
+		    int threads, FILE *out, long long *write_ns)
+{
+	KEY_T **arr = (KEY_T **)data;
+	if (threads > 1) {
+		size_t total = 0;
+		for (int i = 0; i < cnt; ++i)
+			total += size[i];
+		if (total > limit)
+			total = limit;
+		KEY_T *merged = malloc((total != 0 ? total : 1) * sizeof(*merged));
+		struct merge_task tasks[threads];
+		pthread_t tids[threads];
+		for (int i = 0; i < threads; ++i) {
+			tasks[i].data = data;
+			tasks[i].size = size;
+			tasks[i].cnt = cnt;
+			tasks[i].rank_begin = total * i / threads;
+			tasks[i].rank_end = total * (i + 1) / threads;
+			tasks[i].out = merged;
+			// without a thread the segment is merged right here
+			tasks[i].is_thread = pthread_create(&tids[i], NULL,
+							    KEY_FN(merge_thread),
+							    &tasks[i]) == 0;
+			if (!tasks[i].is_thread)
+				KEY_FN(merge_thread)(&tasks[i]);
+		}
+		for (int i = 0; i < threads; ++i) {
+			if (tasks[i].is_thread)
+				pthread_join(tids[i], NULL);
+			KEY_FN(write)(tasks[i].text, tasks[i].text_len, out, write_ns);
+			free(tasks[i].text);
+		}
+		free(merged);
+		return;
+	}
+	size_t *idx = calloc(cnt, sizeof(*idx));
+	char buf[1 << 16];
+	size_t used = 0;
+	int min_idx;
+	for (size_t k = 0; k < limit &&
+	     (min_idx = KEY_FN(merge)(arr, size, idx, cnt)) != -1; ++k) {
+		if (used + KEY_PRINT_MAX + 1 > sizeof(buf)) {
+			KEY_FN(write)(buf, used, out, write_ns);
+			used = 0;
+		}
+		used += KEY_PRINT(buf + used, arr[min_idx][idx[min_idx]]);
+		buf[used++] = ' ';
+		idx[min_idx]++;
+	}
+	KEY_FN(write)(buf, used, out, write_ns);
+	free(idx);
+}
+
+static const struct key_ops KEY_FN(key_ops) = {
+	.name = KEY_STR(KEY_NAME),
+	.size = sizeof(KEY_T),
+	.parse = KEY_FN(parse_array),
+	.select = KEY_FN(select),
+	.parse_range = KEY_FN(parse_range),
+	.sort = KEY_FN(sort),
+	.merge_write = KEY_FN(merge_write),
+};
+
+#undef KEY_FN
+#undef KEY_STR
+#undef KEY_STR_
+#undef KEY_CAT
+#undef KEY_CAT_
+#undef KEY_NAME
+#undef KEY_T
+#undef KEY_LESS
+#undef KEY_PARSE
+#undef KEY_PRINT
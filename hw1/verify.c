@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "keys.h"
+
+// Checks that a file contains a not decreasing sequence of values and,
+// optionally, that it is a permutation of the input files. Files are
+// mmaped, so the output size is limited by the address space only.
+
+// order independent hash of a multiset of values
+struct multiset_hash {
+	unsigned long long count;
+	uint64_t sum; // sum of mixed values
+	uint64_t sum2; // sum of squares of mixed values, the second half of the hash
+};
+
+// result of the output check
+struct check_result {
+	bool is_sorted;
+	struct multiset_hash hash;
+};
+
+static void multiset_hash_add(struct multiset_hash *h, uint64_t mixed) {
+	h->count++;
+	h->sum += mixed;
+	h->sum2 += mixed * mixed;
+}
+
+// generates check and hash loops for one key type, without any dispatch inside
+#define VERIFY_KERNELS(name, T, less_fn, parse_fn, hash_fn, print_fn)	\
+static void check_##name(const char *begin, const char *end,		\
+			 struct check_result *res) {			\
+	const char *pos = begin;					\
+	T prev = {0}, v;						\
+	bool has_prev = false;						\
+	const char *next = NULL;					\
+	while ((next = parse_fn(pos, end, &v)) != NULL &&		\
+	       next != PARSE_OUT_OF_RANGE) {				\
+		if (has_prev && less_fn(v, prev) && res->is_sorted) {	\
+			char a[KEY_PRINT_MAX + 1], b[KEY_PRINT_MAX + 1];\
+			a[print_fn(a, prev)] = 0;			\
+			b[print_fn(b, v)] = 0;				\
+			printf("Error on numbers %s %s at offset %zu\n",\
+			       a, b, (size_t)(parse_skip_space(pos, end) - begin));\
+			res->is_sorted = false;				\
+		}							\
+		multiset_hash_add(&res->hash, hash_fn(v));		\
+		prev = v;						\
+		has_prev = true;					\
+		pos = next;						\
+	}								\
+	pos = parse_skip_space(pos, end);				\
+	if (next == PARSE_OUT_OF_RANGE && res->is_sorted) {		\
+		printf("Error: value out of range at offset %zu\n",	\
+		       (size_t)(pos - begin));				\
+		res->is_sorted = false;					\
+	}								\
+	if (pos != end && res->is_sorted) {				\
+		printf("Error: garbage at offset %zu\n",		\
+		       (size_t)(pos - begin));				\
+		res->is_sorted = false;					\
+	}								\
+}									\
+									\
+static void hash_##name(const char *pos, const char *end,		\
+			struct multiset_hash *h) {			\
+	T v;								\
+	while ((pos = parse_fn(pos, end, &v)) != NULL &&		\
+	       pos != PARSE_OUT_OF_RANGE)				\
+		multiset_hash_add(h, hash_fn(v));			\
+}
+
+VERIFY_KERNELS(int, int, key_less_scalar, parse_int, key_hash_scalar, print_int)
+VERIFY_KERNELS(int64, int64_t, key_less_scalar, parse_int64, key_hash_scalar, print_int64)
+VERIFY_KERNELS(uint32, uint32_t, key_less_scalar, parse_uint32, key_hash_scalar, print_uint32)
+VERIFY_KERNELS(uint64, uint64_t, key_less_scalar, parse_uint64, key_hash_scalar, print_uint64)
+VERIFY_KERNELS(kv, struct kv_record, key_less_kv, parse_kv, key_hash_kv, print_kv)
+
+struct verify_ops {
+	const char *name;
+	void (*check)(const char *begin, const char *end, struct check_result *res);
+	void (*hash)(const char *pos, const char *end, struct multiset_hash *h);
+};
+
+static const struct verify_ops all_ops[] = {
+	{"int", check_int, hash_int},
+	{"int64", check_int64, hash_int64},
+	{"uint32", check_uint32, hash_uint32},
+	{"uint64", check_uint64, hash_uint64},
+	{"kv", check_kv, hash_kv},
+};
+
+// mmaps the whole file read-only, returns NULL for empty files too
+static const char *map_file(const char *path, size_t *len, bool *is_ok) {
+	*len = 0;
+	*is_ok = false;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s\n", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	*is_ok = true;
+	if (st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap %s\n", path);
+		*is_ok = false;
+		return NULL;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	*len = st.st_size;
+	return data;
+}
+
+static double elapsed_sec(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+	const char *prog = argv[0];
+	const struct verify_ops *ops = &all_ops[0];
+	int opt;
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		ops = NULL;
+		for (size_t i = 0; opt == 't' && i < sizeof(all_ops) / sizeof(all_ops[0]); ++i) {
+			if (strcmp(all_ops[i].name, optarg) == 0)
+				ops = &all_ops[i];
+		}
+		if (ops == NULL)
+			break;
+	}
+	if (ops == NULL || optind >= argc) {
+		fprintf(stderr, "Invalid command line arguments. Use the next format:\n");
+		fprintf(stderr, "%s [-t type] out_file [input files list]\n", prog);
+		fprintf(stderr, "type - key type: int, int64, uint32, uint64, kv (default int)\n");
+		fprintf(stderr, "With input files the output is also checked to be their permutation\n");
+		return 1;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t out_len;
+	bool is_ok;
+	const char *out = map_file(argv[optind], &out_len, &is_ok);
+	if (!is_ok)
+		return 1;
+	struct check_result res = {.is_sorted = true};
+	ops->check(out, out + out_len, &res);
+	if (out != NULL)
+		munmap((void *)out, out_len);
+	size_t total_len = out_len;
+
+	bool is_same = true;
+	if (optind + 1 < argc) {
+		struct multiset_hash in_hash = {0};
+		for (int i = optind + 1; i < argc; ++i) {
+			size_t len;
+			const char *in = map_file(argv[i], &len, &is_ok);
+			if (!is_ok)
+				return 1;
+			ops->hash(in, in + len, &in_hash);
+			if (in != NULL)
+				munmap((void *)in, len);
+			total_len += len;
+		}
+		if (in_hash.count != res.hash.count) {
+			printf("Error: %llu values in the output, %llu in the inputs\n",
+				res.hash.count, in_hash.count);
+			is_same = false;
+		} else if (in_hash.sum != res.hash.sum || in_hash.sum2 != res.hash.sum2) {
+			printf("Error: the output is not a permutation of the inputs\n");
+			is_same = false;
+		}
+	}
+
+	double sec = elapsed_sec(&start);
+	printf("checked %llu values, %zu bytes in %.3f s, %.1f MB/s\n",
+		res.hash.count, total_len, sec, sec > 0 ? total_len / sec / 1e6 : 0.0);
+	if (!res.is_sorted || !is_same)
+		return 1;
+	printf("All is ok\n");
+	return 0;
+}
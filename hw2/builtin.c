@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include "builtin.h"
+#include "jobs.h"
+#include "parser.h"
+#include "path.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+// Common commands which are cheap enough to run without a process:
+// echo, printf, pwd, true, false and cat of files, and hash, jobs, wait
+// and fg which work with the shell's own state. They do not read stdin, so their output can be
+// produced right away and written wherever it goes.
+
+static void out_buf_reserve(struct out_buf *out, size_t len) {
+	if (out->size + len > out->cap) {
+		out->cap = (out->cap + 1) * 2;
+		if (out->cap < out->size + len)
+			out->cap = out->size + len;
+		out->data = realloc(out->data, out->cap);
+	}
+}
+
+void out_buf_append(struct out_buf *out, const char *str, size_t len) {
+	if (len == 0)
+		return;
+	out_buf_reserve(out, len);
+	memcpy(out->data + out->size, str, len);
+	out->size += len;
+}
+
+void out_buf_append_file(struct out_buf *out, int fd) {
+	if (out->file_count == out->file_cap) {
+		out->file_cap = out->file_cap == 0 ? 4 : out->file_cap * 2;
+		out->files = realloc(out->files, out->file_cap * sizeof(*out->files));
+	}
+	out->files[out->file_count].offset = out->size;
+	out->files[out->file_count].fd = fd;
+	out->file_count++;
+}
+
+bool out_buf_is_empty(const struct out_buf *out) {
+	return out->size == 0 && out->file_count == 0;
+}
+
+static bool write_all(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return false;
+		data += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+// moves the rest of the file into fd inside the kernel, with read() and
+// write() only if the pair of fds does not support it, like a file
+// opened with O_APPEND or a file of /proc
+static bool send_file(int fd, int file) {
+	struct stat st;
+	bool is_pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+	while (true) {
+		ssize_t rc;
+		if (is_pipe)
+			rc = splice(file, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE);
+		else
+			rc = sendfile(fd, file, NULL, 1 << 30);
+		if (rc == 0)
+			return true;
+		if (rc > 0 || errno == EINTR)
+			continue;
+		if (errno != EINVAL && errno != ENOSYS)
+			return false;
+		break;
+	}
+	char buf[1 << 16];
+	ssize_t rc;
+	while ((rc = read(file, buf, sizeof(buf))) != 0) {
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 || !write_all(fd, buf, rc))
+			return false;
+	}
+	return true;
+}
+
+void out_buf_write(const struct out_buf *out, int fd) {
+	size_t pos = 0;
+	for (size_t i = 0; i < out->file_count; ++i) {
+		const struct out_file *f = &out->files[i];
+		if (!write_all(fd, out->data + pos, f->offset - pos) || !send_file(fd, f->fd))
+			return;
+		pos = f->offset;
+	}
+	write_all(fd, out->data + pos, out->size - pos);
+}
+
+void out_buf_destroy(struct out_buf *out) {
+	for (size_t i = 0; i < out->file_count; ++i)
+		close(out->files[i].fd);
+	free(out->files);
+	free(out->data);
+	out->files = NULL;
+	out->data = NULL;
+	out->size = 0;
+	out->cap = 0;
+	out->file_count = 0;
+	out->file_cap = 0;
+}
+
+// appends a string formatted by a %s spec with flags, width and precision
+static void out_buf_append_spec(struct out_buf *out, const char *spec, const char *str) {
+	int len = snprintf(NULL, 0, spec, str);
+	out_buf_reserve(out, len + 1);
+	snprintf(out->data + out->size, len + 1, spec, str);
+	out->size += len;
+}
+
+static void out_buf_putc(struct out_buf *out, char c) {
+	out_buf_append(out, &c, 1);
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// decodes the backslash escape at s, appends it to out and returns the
+// position after it
+// octal is \0NNN for echo and %b, \NNN for the printf format
+// returns NULL on \c, which ends the whole output
+static const char *decode_escape(const char *s, struct out_buf *out, bool is_zero_octal) {
+	const char *pos = s + 1;
+	char c = *pos;
+	switch (c) {
+	case 'a': out_buf_putc(out, '\a'); return pos + 1;
+	case 'b': out_buf_putc(out, '\b'); return pos + 1;
+	case 'e': out_buf_putc(out, 27); return pos + 1;
+	case 'f': out_buf_putc(out, '\f'); return pos + 1;
+	case 'n': out_buf_putc(out, '\n'); return pos + 1;
+	case 'r': out_buf_putc(out, '\r'); return pos + 1;
+	case 't': out_buf_putc(out, '\t'); return pos + 1;
+	case 'v': out_buf_putc(out, '\v'); return pos + 1;
+	case '\\': out_buf_putc(out, '\\'); return pos + 1;
+	case 'c': return NULL;
+	case 'x': {
+		int v = 0;
+		int i = 0;
+		for (; i < 2 && hex_value(pos[1 + i]) >= 0; ++i)
+			v = v * 16 + hex_value(pos[1 + i]);
+		if (i == 0)
+			break;
+		out_buf_putc(out, v);
+		return pos + 1 + i;
+	}
+	default:
+		if (c < '0' || c > '7' || (is_zero_octal && c != '0'))
+			break;
+		if (is_zero_octal)
+			++pos;
+		int v = 0;
+		int i = 0;
+		for (; i < 3 && pos[i] >= '0' && pos[i] <= '7'; ++i)
+			v = v * 8 + pos[i] - '0';
+		out_buf_putc(out, v);
+		return pos + i;
+	}
+	// unknown escape is printed as is
+	out_buf_putc(out, '\\');
+	return pos;
+}
+
+// appends the string with the escapes decoded, false on \c
+static bool append_escaped(struct out_buf *out, const char *s, bool is_zero_octal) {
+	while (*s != 0) {
+		const char *next = strchr(s, '\\');
+		if (next == NULL) {
+			out_buf_append(out, s, strlen(s));
+			break;
+		}
+		out_buf_append(out, s, next - s);
+		if (next[1] == 0) {
+			out_buf_putc(out, '\\');
+			break;
+		}
+		s = decode_escape(next, out, is_zero_octal);
+		if (s == NULL)
+			return false;
+	}
+	return true;
+}
+
+// echo [-neE] args, like coreutils echo
+static bool builtin_echo(const struct command *cmd, struct out_buf *out, int *status) {
+	bool is_newline = true;
+	bool is_escape = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 || strspn(arg + 1, "neE") != strlen(arg + 1))
+			break;
+		for (const char *c = arg + 1; *c != 0; ++c) {
+			if (*c == 'n')
+				is_newline = false;
+			else
+				is_escape = *c == 'e';
+		}
+	}
+	*status = 0;
+	for (uint32_t first = i; i < cmd->arg_count; ++i) {
+		if (i != first)
+			out_buf_putc(out, ' ');
+		if (!is_escape)
+			out_buf_append(out, cmd->args[i], strlen(cmd->args[i]));
+		else if (!append_escaped(out, cmd->args[i], true))
+			return true;
+	}
+	if (is_newline)
+		out_buf_putc(out, '\n');
+	return true;
+}
+
+// parses a printf numeric argument, false if it is not a number
+static bool parse_number(const char *arg, bool is_signed, long long *out) {
+	if (*arg == 0) {
+		*out = 0;
+		return true;
+	}
+	if (*arg == '\'' || *arg == '"') {
+		*out = (unsigned char)arg[1];
+		return true;
+	}
+	char *end;
+	errno = 0;
+	if (is_signed)
+		*out = strtoll(arg, &end, 0);
+	else
+		*out = (long long)strtoull(arg, &end, 0);
+	return errno == 0 && *end == 0;
+}
+
+// printf format [args], the format is reused while there are arguments
+// conversions: %% %s %b %c %d %i %o %u %x %X with flags, width and precision
+// anything else is left to the external printf
+static bool builtin_printf(const struct command *cmd, struct out_buf *out, int *status) {
+	if (cmd->arg_count == 0)
+		return false;
+	const char *format = cmd->args[0];
+	uint32_t arg = 1;
+	char spec[64];
+	char buf[128];
+	do {
+		uint32_t arg_start = arg;
+		const char *pos = format;
+		while (*pos != 0) {
+			if (*pos == '\\') {
+				if (pos[1] == 0) {
+					out_buf_putc(out, '\\');
+					break;
+				}
+				pos = decode_escape(pos, out, false);
+				if (pos == NULL)
+					goto done;
+				continue;
+			}
+			if (*pos != '%') {
+				size_t len = strcspn(pos, "\\%");
+				out_buf_append(out, pos, len);
+				pos += len;
+				continue;
+			}
+			if (pos[1] == '%') {
+				out_buf_putc(out, '%');
+				pos += 2;
+				continue;
+			}
+			size_t len = 1 + strspn(pos + 1, "-+ #0");
+			len += strspn(pos + len, "0123456789");
+			if (pos[len] == '.') {
+				++len;
+				len += strspn(pos + len, "0123456789");
+			}
+			char conv = pos[len];
+			if (conv == 0 || strchr("sbcdiouxX", conv) == NULL || len + 3 > sizeof(spec))
+				return false;
+			const char *value = arg < cmd->arg_count ? cmd->args[arg++] : "";
+			memcpy(spec, pos, len);
+			pos += len + 1;
+			int printed;
+			long long number;
+			switch (conv) {
+			case 'b': {
+				struct out_buf decoded = {0};
+				bool is_continued = append_escaped(&decoded, value, true);
+				out_buf_putc(&decoded, 0);
+				spec[len] = 's';
+				spec[len + 1] = 0;
+				out_buf_append_spec(out, spec, decoded.data);
+				free(decoded.data);
+				if (!is_continued)
+					goto done;
+				continue;
+			}
+			case 's':
+				spec[len] = 's';
+				spec[len + 1] = 0;
+				out_buf_append_spec(out, spec, value);
+				continue;
+			case 'c':
+				// a NUL char is left to the external printf
+				if (value[0] == 0)
+					return false;
+				spec[len] = 'c';
+				spec[len + 1] = 0;
+				printed = snprintf(buf, sizeof(buf), spec, value[0]);
+				if (printed >= (int)sizeof(buf))
+					return false;
+				break;
+			default:
+				if (!parse_number(value, conv == 'd' || conv == 'i', &number))
+					return false;
+				spec[len] = 'l';
+				spec[len + 1] = 'l';
+				spec[len + 2] = conv;
+				spec[len + 3] = 0;
+				printed = snprintf(buf, sizeof(buf), spec, number);
+				if (printed >= (int)sizeof(buf))
+					return false;
+				break;
+			}
+			out_buf_append(out, buf, printed);
+		}
+		// the format is reused only if it has consumed something
+		if (arg == arg_start)
+			break;
+	} while (arg < cmd->arg_count);
+done:
+	*status = 0;
+	return true;
+}
+
+// pwd without options
+static bool builtin_pwd(const struct command *cmd, struct out_buf *out, int *status) {
+	if (cmd->arg_count != 0)
+		return false;
+	char *dir = getcwd(NULL, 0);
+	if (dir == NULL)
+		return false;
+	out_buf_append(out, dir, strlen(dir));
+	out_buf_putc(out, '\n');
+	free(dir);
+	*status = 0;
+	return true;
+}
+
+static bool builtin_true(const struct command *cmd, struct out_buf *out, int *status) {
+	(void)cmd;
+	(void)out;
+	*status = 0;
+	return true;
+}
+
+static bool builtin_false(const struct command *cmd, struct out_buf *out, int *status) {
+	(void)cmd;
+	(void)out;
+	*status = 1;
+	return true;
+}
+
+// cat files: the files are not read by the shell, they are sent where
+// the output goes by the kernel
+// cat of stdin and cat with options are left to the external cat
+static bool builtin_cat(const struct command *cmd, struct out_buf *out, int *status) {
+	if (cmd->arg_count == 0)
+		return false;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		if (cmd->args[i][0] == '-')
+			return false;
+	}
+	*status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		int fd = open(cmd->args[i], O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+			close(fd);
+			fd = -1;
+			errno = EISDIR;
+		}
+		if (fd < 0) {
+			fprintf(stderr, "cat: %s: %s\n", cmd->args[i], strerror(errno));
+			*status = 1;
+			continue;
+		}
+		out_buf_append_file(out, fd);
+	}
+	return true;
+}
+
+// hash [-r] [names]: prints the cached command paths, -r drops them,
+// names are looked up and cached
+static bool builtin_hash(const struct command *cmd, struct out_buf *out, int *status) {
+	*status = 0;
+	uint32_t i = 0;
+	if (cmd->arg_count == 0) {
+		size_t size = out->size;
+		path_print(out);
+		if (out->size == size)
+			fprintf(stderr, "hash: hash table empty\n");
+		return true;
+	}
+	if (strcmp(cmd->args[0], "-r") == 0) {
+		path_clear();
+		++i;
+	}
+	for (; i < cmd->arg_count; ++i) {
+		if (path_resolve(cmd->args[i]) == NULL) {
+			fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+			*status = 1;
+		}
+	}
+	return true;
+}
+
+// jobs: prints the background jobs, the finished ones are forgotten
+static bool builtin_jobs(const struct command *cmd, struct out_buf *out, int *status) {
+	if (cmd->arg_count != 0)
+		return false;
+	jobs_print(out, false);
+	*status = 0;
+	return true;
+}
+
+// wait [%n|pid...]: waits for the given background jobs and returns the
+// status of the last one, or for all of them with status 0
+static bool builtin_wait(const struct command *cmd, struct out_buf *out, int *status) {
+	(void)out;
+	*status = 0;
+	if (cmd->arg_count == 0) {
+		jobs_wait_all(false);
+		return true;
+	}
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		struct job *job = job_find(cmd->args[i]);
+		if (job == NULL) {
+			fprintf(stderr, "wait: %s: no such job\n", cmd->args[i]);
+			*status = 127;
+			continue;
+		}
+		*status = job_wait(job);
+		job_delete(job);
+	}
+	return true;
+}
+
+// fg [%n]: the shell has no job control, so it just waits for the job
+// in the foreground, the current one by default
+static bool builtin_fg(const struct command *cmd, struct out_buf *out, int *status) {
+	if (cmd->arg_count > 1)
+		return false;
+	const char *spec = cmd->arg_count == 0 ? NULL : cmd->args[0];
+	struct job *job = job_find(spec);
+	if (job == NULL) {
+		if (spec == NULL)
+			fprintf(stderr, "fg: no current job\n");
+		else
+			fprintf(stderr, "fg: %s: no such job\n", spec);
+		*status = 1;
+		return true;
+	}
+	// goes where fg's output goes, after the output of the job, which
+	// writes into the shell's stdout on its own
+	out_buf_append(out, job->text, strlen(job->text));
+	out_buf_putc(out, '\n');
+	*status = job_wait(job);
+	job_delete(job);
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)(const struct command *cmd, struct out_buf *out, int *status);
+} builtins[] = {
+	{"echo", builtin_echo},
+	{"printf", builtin_printf},
+	{"pwd", builtin_pwd},
+	{"true", builtin_true},
+	{"false", builtin_false},
+	{"cat", builtin_cat},
+	{"hash", builtin_hash},
+	{"jobs", builtin_jobs},
+	{"wait", builtin_wait},
+	{"fg", builtin_fg},
+};
+
+bool builtin_run(const struct command *cmd, struct out_buf *out, int *status) {
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+		if (strcmp(cmd->exe, builtins[i].name) != 0)
+			continue;
+		size_t size = out->size;
+		if (builtins[i].run(cmd, out, status))
+			return true;
+		// the partial output is dropped, the external command redoes it
+		out->size = size;
+		return false;
+	}
+	return false;
+}
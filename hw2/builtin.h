@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct command;
+
+// a file whose whole content goes into the output at the offset
+struct out_file {
+	size_t offset;
+	int fd;
+};
+
+// output of an in-process command, written by the shell where the
+// command's stdout goes: the terminal, a file or a pipe
+struct out_buf {
+	char *data;
+	size_t size;
+	size_t cap;
+	// files sent by the kernel without copying them through the shell
+	struct out_file *files;
+	size_t file_count;
+	size_t file_cap;
+};
+
+void out_buf_append(struct out_buf *out, const char *str, size_t len);
+
+// appends the rest of the file, the buffer owns the fd from now on
+void out_buf_append_file(struct out_buf *out, int fd);
+
+bool out_buf_is_empty(const struct out_buf *out);
+
+// writes the output into fd, the files are moved with splice() into a
+// pipe and with sendfile() into anything else
+void out_buf_write(const struct out_buf *out, int fd);
+
+// frees the data and closes the files
+void out_buf_destroy(struct out_buf *out);
+
+// runs a command in the shell process if it is a builtin, the output is
+// appended to out
+// returns false if the command is not a builtin or the builtin can't
+// handle its arguments, then the external command has to be run
+bool builtin_run(const struct command *cmd, struct out_buf *out, int *status);
@@ -77,7 +77,9 @@ tests = [
 [
 "sleep 0.5 && echo 'back sleep is done' &",
 "echo 'next sleep is done'",
-"sleep 0.5",
+# longer than the background sleep, the shell does not wait for the
+# background job to get going, on a busy machine it starts a bit later
+"sleep 1",
 "sleep 0.1 && exit 1 &",
 "echo 100",
 ]
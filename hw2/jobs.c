@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "builtin.h"
+#include "jobs.h"
+#include "parser.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+static struct {
+	struct job *head;
+	int sigfd;
+	int last_track;
+} table = {NULL, -1, TRACE_TRACK_FOREGROUND};
+
+void jobs_init(void) {
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	table.sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static void job_free(struct job *job) {
+	if (job->line != NULL)
+		command_line_delete(job->line);
+	free(job->procs);
+	free(job->text);
+	free(job);
+}
+
+void jobs_destroy(void) {
+	while (table.head != NULL) {
+		struct job *job = table.head;
+		table.head = job->next;
+		job_free(job);
+	}
+	if (table.sigfd != -1)
+		close(table.sigfd);
+	table.sigfd = -1;
+}
+
+struct job *job_new(void) {
+	struct job *job = calloc(1, sizeof(*job));
+	job->track = ++table.last_track;
+	job->next = table.head;
+	table.head = job;
+	return job;
+}
+
+static struct job_proc *job_add(struct job *job, pid_t pid) {
+	if (job->proc_count == job->proc_capacity) {
+		job->proc_capacity = job->proc_capacity == 0 ? 4 : job->proc_capacity * 2;
+		job->procs = realloc(job->procs, job->proc_capacity * sizeof(*job->procs));
+	}
+	struct job_proc *proc = &job->procs[job->proc_count++];
+	memset(proc, 0, sizeof(*proc));
+	proc->pid = pid;
+	proc->start_ns = stats_now();
+	proc->path_ns = proc->start_ns;
+	proc->exec_ns = proc->start_ns;
+	proc->end_ns = proc->start_ns;
+	return proc;
+}
+
+struct job_proc *job_add_pid(struct job *job, pid_t pid) {
+	job->running++;
+	return job_add(job, pid);
+}
+
+struct job_proc *job_add_done(struct job *job, int status) {
+	struct job_proc *proc = job_add(job, -1);
+	proc->status = status;
+	proc->is_done = true;
+	return proc;
+}
+
+// stores the status of a reaped child, the children of no job (there
+// should be none) are just forgotten
+static void job_proc_exited(pid_t pid, int status, const struct rusage *usage) {
+	for (struct job *job = table.head; job != NULL; job = job->next) {
+		for (int i = 0; i < job->proc_count; ++i) {
+			struct job_proc *proc = &job->procs[i];
+			if (proc->pid != pid || proc->is_done)
+				continue;
+			proc->status = WIFEXITED(status) ? WEXITSTATUS(status) : status;
+			proc->is_done = true;
+			proc->end_ns = stats_now();
+			proc->usage = *usage;
+			job->running--;
+			trace_proc(job, proc);
+			return;
+		}
+	}
+}
+
+// the job has processes or a part of its chain to run
+static bool job_is_running(const struct job *job) {
+	return job->running > 0 || job->on_done != NULL;
+}
+
+void jobs_reap(void) {
+	// the signals are only wakeups, several exits can be merged into one
+	struct signalfd_siginfo info;
+	while (read(table.sigfd, &info, sizeof(info)) == sizeof(info))
+		;
+	int status;
+	struct rusage usage;
+	pid_t pid;
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+		job_proc_exited(pid, status, &usage);
+	// a callback can start commands which add and delete jobs, so the
+	// walk starts over after each one
+	bool is_called = true;
+	while (is_called) {
+		is_called = false;
+		for (struct job *job = table.head; job != NULL; job = job->next) {
+			if (job->running > 0 || job->on_done == NULL || job->in_callback)
+				continue;
+			job->in_callback = true;
+			job->on_done(job);
+			job->in_callback = false;
+			is_called = true;
+			break;
+		}
+	}
+}
+
+int jobs_fd(void) {
+	return table.sigfd;
+}
+
+int job_wait(struct job *job) {
+	jobs_reap();
+	// the commands run by callbacks meanwhile do not wait for it and do
+	// not delete it
+	bool was_waited = job->is_waited;
+	job->is_waited = true;
+	// the job which is waited from its own callback has only the
+	// current pipeline to wait for
+	while (job->running > 0 || (job->on_done != NULL && !job->in_callback)) {
+		// a child exited after the last wait4() keeps the fd readable
+		struct pollfd pfd = {table.sigfd, POLLIN, 0};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		jobs_reap();
+	}
+	job->is_waited = was_waited;
+	int status = 0;
+	for (int i = 0; i < job->proc_count; ++i) {
+		struct job_proc *proc = &job->procs[i];
+		if (proc->has_writer) {
+			void *writer_status;
+			pthread_join(proc->writer, &writer_status);
+			proc->has_writer = false;
+			if (writer_status != NULL)
+				proc->status = (int)(intptr_t)writer_status;
+		}
+		status = proc->status;
+	}
+	return status;
+}
+
+void job_clear(struct job *job) {
+	job->proc_count = 0;
+	job->running = 0;
+}
+
+void job_delete(struct job *job) {
+	struct job **pos = &table.head;
+	while (*pos != job)
+		pos = &(*pos)->next;
+	*pos = job->next;
+	job_free(job);
+}
+
+void job_set_background(struct job *job, char *text) {
+	int id = 0;
+	for (struct job *j = table.head; j != NULL; j = j->next) {
+		if (j->id > id)
+			id = j->id;
+	}
+	job->id = id + 1;
+	job->text = text;
+	trace_name_job(job, text);
+}
+
+// a chain does not see its own job, nor a job which is already waited
+// for by someone else
+static bool job_is_visible(const struct job *job) {
+	return job->id != 0 && !job->in_callback && !job->is_waited;
+}
+
+// the current job is the last started one, the previous is the one
+// started before it, the table keeps the newest jobs first
+static struct job *job_nth_background(int n) {
+	for (struct job *j = table.head; j != NULL; j = j->next) {
+		if (job_is_visible(j) && n-- == 0)
+			return j;
+	}
+	return NULL;
+}
+
+struct job *job_find(const char *spec) {
+	if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0)
+		return job_nth_background(0);
+	if (strcmp(spec, "%-") == 0)
+		return job_nth_background(1);
+	char *end;
+	long n = strtol(spec + (*spec == '%'), &end, 10);
+	if (*end != 0 || end == spec + (*spec == '%'))
+		return NULL;
+	for (struct job *j = table.head; j != NULL; j = j->next) {
+		if (!job_is_visible(j))
+			continue;
+		if (*spec == '%' && j->id == n)
+			return j;
+		for (int i = 0; *spec != '%' && i < j->proc_count; ++i) {
+			if (j->procs[i].pid == n)
+				return j;
+		}
+	}
+	return NULL;
+}
+
+void jobs_print(struct out_buf *out, bool only_done) {
+	jobs_reap();
+	int count = 0;
+	for (struct job *j = table.head; j != NULL; j = j->next)
+		count += job_is_visible(j);
+	if (count == 0)
+		return;
+	// the table keeps the newest first, they are printed the oldest first
+	struct job **jobs = malloc(count * sizeof(*jobs));
+	int i = count;
+	for (struct job *j = table.head; j != NULL; j = j->next) {
+		if (job_is_visible(j))
+			jobs[--i] = j;
+	}
+	for (i = 0; i < count; ++i) {
+		struct job *job = jobs[i];
+		if (only_done && job_is_running(job))
+			continue;
+		int status = job->procs[job->proc_count - 1].status;
+		char state[32];
+		if (job_is_running(job))
+			strcpy(state, "Running");
+		else if (status == 0)
+			strcpy(state, "Done");
+		else
+			snprintf(state, sizeof(state), "Exit %d", status);
+		char mark = i == count - 1 ? '+' : i == count - 2 ? '-' : ' ';
+		char head[64];
+		int len = snprintf(head, sizeof(head), "[%d]%c  %-24s", job->id, mark, state);
+		out_buf_append(out, head, len);
+		out_buf_append(out, job->text, strlen(job->text));
+		if (job_is_running(job)) {
+			out_buf_append(out, " &\n", 3);
+		} else {
+			out_buf_append(out, "\n", 1);
+			job_wait(job);
+			job_delete(job);
+		}
+	}
+	free(jobs);
+}
+
+void jobs_wait_all(bool only_chains) {
+	bool is_found = true;
+	while (is_found) {
+		is_found = false;
+		for (struct job *job = table.head; job != NULL; job = job->next) {
+			if (!job_is_visible(job) || (only_chains && job->on_done == NULL))
+				continue;
+			job_wait(job);
+			job_delete(job);
+			is_found = true;
+			break;
+		}
+	}
+}
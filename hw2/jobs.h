@@ -0,0 +1,115 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+// Table of the jobs the shell has started. SIGCHLD is blocked and read
+// from a signalfd. When it comes, every exited child is reaped with
+// wait4(WNOHANG), and its status and rusage are stored in the job it belongs to,
+// in whatever order the children exit. Waiting for a job sleeps in
+// poll() on the signalfd until all its processes are done.
+
+struct job_proc {
+	pid_t pid; // -1 if the command has not started, status is known
+	int status;
+	bool is_done;
+	// a builtin's output is written into a pipe or a file by writer, its
+	// non-NULL result is the status
+	bool has_writer;
+	pthread_t writer;
+	// the command and the resources it has used, for the stats and the
+	// trace: the path is found by path_ns and exec succeeds by exec_ns
+	const struct command *cmd;
+	long long start_ns;
+	long long path_ns;
+	long long exec_ns;
+	long long end_ns;
+	struct rusage usage;
+};
+
+struct command;
+struct command_line;
+struct expr;
+struct out_buf;
+
+// processes of one pipeline, the last one gives the job status
+struct job {
+	struct job_proc *procs;
+	int proc_count;
+	int proc_capacity;
+	// processes which are not reaped yet
+	int running;
+	// number of a background job, 0 for the foreground one
+	int id;
+	// command line of a background job for jobs and fg
+	char *text;
+	// a background && or || chain: the line, which is freed with the
+	// job, and the operator after the running pipeline
+	struct command_line *line;
+	struct expr *next_op;
+	// called when all the processes are done, it can start the next
+	// pipeline of the chain into the job, it is reset when the chain ends
+	void (*on_done)(struct job *job);
+	bool in_callback;
+	bool is_waited;
+	// in the trace, a new one for each job unless the shell sets it
+	int track;
+	struct job *next;
+};
+
+// blocks SIGCHLD and opens the signalfd, must be called before any
+// child is started
+void jobs_init(void);
+
+// deletes all the jobs and closes the signalfd, the children which are
+// still running are not waited for
+void jobs_destroy(void);
+
+// creates an empty job and adds it to the table
+struct job *job_new(void);
+
+// adds a started process to the job, it starts and ends now unless
+// the caller sets otherwise
+struct job_proc *job_add_pid(struct job *job, pid_t pid);
+
+// adds a command which has finished or failed to start, returns its
+// process to attach a writer thread to it
+struct job_proc *job_add_done(struct job *job, int status);
+
+// reaps the exited children without blocking and continues the
+// chains whose pipelines are done
+void jobs_reap(void);
+
+// the signalfd, readable when a child has exited
+int jobs_fd(void);
+
+// waits until all the processes of the job are done and its chain has
+// ended, returns the status of the last one
+int job_wait(struct job *job);
+
+// forgets the processes of a waited job, to start the next ones in it
+void job_clear(struct job *job);
+
+// makes the job a background one with the next free number, the text
+// is freed with the job
+void job_set_background(struct job *job, char *text);
+
+// finds a background job by %n, %+, %- or a pid of its processes, the
+// current one (the last started) if spec is NULL
+// the jobs whose chain is being continued or which are being waited for
+// are not seen
+struct job *job_find(const char *spec);
+
+// prints the background jobs like "[1]+  Running    sleep 10 &", only
+// the finished ones if only_done, those are deleted after that
+void jobs_print(struct out_buf *out, bool only_done);
+
+// waits for all the background jobs and deletes them, only those with
+// an unfinished chain if only_chains
+void jobs_wait_all(bool only_chains);
+
+// removes the job from the table and frees it, its writer threads must
+// be joined by job_wait() before
+void job_delete(struct job *job);
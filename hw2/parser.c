@@ -2,14 +2,13 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -20,30 +19,80 @@ enum token_type {
 	TOKEN_TYPE_OR,
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
+	TOKEN_TYPE_IN,
+	TOKEN_TYPE_HEREDOC,
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/** Command substitution in the current token. */
+struct token_subst {
+	/** Where it is in the decoded token. */
+	uint32_t offset;
+	/** Its text in the token's subst_text, 0 terminated. */
+	uint32_t text_start;
+	bool is_quoted;
+};
+
+/**
+ * A token is a slice of the input until it meets a quote, an escape or
+ * a substitution. Only then it is decoded into its own buffer.
+ */
 struct token {
 	enum token_type type;
+	/** Offset of the token in the not consumed input. */
+	uint32_t start;
+	/** Decoded text, valid if is_decoded. */
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
+	bool is_decoded;
+	struct token_subst *substs;
+	uint32_t subst_count;
+	uint32_t subst_capacity;
+	/** Texts of all the substitutions. */
+	char *subst_text;
+	uint32_t subst_size;
+	uint32_t subst_text_capacity;
 };
 
-static char *
-token_strdup(const struct token *t)
+static const char *
+token_text(const struct token *t, const char *input)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	return t->is_decoded ? t->data : input + t->start;
+}
+
+static void
+token_reserve(struct token *t, uint32_t size)
+{
+	if (size <= t->capacity)
+		return;
+	t->capacity = (t->capacity + 1) * 2;
+	if (t->capacity < size)
+		t->capacity = size;
+	t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+}
+
+/** Copy the slice of the input to be able to change it. */
+static void
+token_decode(struct token *t, const char *input)
+{
+	if (t->is_decoded)
+		return;
+	if (t->size > 0) {
+		token_reserve(t, t->size);
+		memcpy(t->data, input + t->start, t->size);
+	}
+	t->is_decoded = true;
 }
 
 static void
 token_append(struct token *t, char c)
 {
+	if (!t->is_decoded) {
+		/* The char is the next one in the input, extend the slice. */
+		++t->size;
+		return;
+	}
 	if (t->size == t->capacity) {
 		t->capacity = (t->capacity + 1) * 2;
 		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
@@ -53,42 +102,318 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+/** Append a span of plain chars, which follow the token in the input. */
+static void
+token_append_span(struct token *t, const char *str, uint32_t len)
+{
+	if (!t->is_decoded) {
+		t->size += len;
+		return;
+	}
+	token_reserve(t, t->size + len);
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
+}
+
+static void
+token_append_subst_char(struct token *t, char c)
+{
+	if (t->subst_size == t->subst_text_capacity) {
+		t->subst_text_capacity = (t->subst_text_capacity + 1) * 2;
+		t->subst_text = realloc(t->subst_text, sizeof(*t->subst_text) *
+					t->subst_text_capacity);
+	}
+	t->subst_text[t->subst_size++] = c;
+}
+
+/** A substitution begins at the end of the decoded token. */
+static void
+token_start_subst(struct token *t, bool is_quoted)
+{
+	assert(t->is_decoded);
+	if (t->subst_count == t->subst_capacity) {
+		t->subst_capacity = (t->subst_capacity + 1) * 2;
+		t->substs = realloc(t->substs, sizeof(*t->substs) *
+				    t->subst_capacity);
+	}
+	struct token_subst *s = &t->substs[t->subst_count++];
+	s->offset = t->size;
+	s->text_start = t->subst_size;
+	s->is_quoted = is_quoted;
+}
+
+/** A token can be an empty string with only a substitution in it. */
+static bool
+token_is_empty(const struct token *t)
+{
+	return t->size == 0 && t->subst_count == 0;
+}
+
 static void
 token_reset(struct token *t)
 {
 	t->size = 0;
+	t->subst_count = 0;
+	t->subst_size = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->start = 0;
+	t->is_decoded = false;
+}
+
+/** Tokenizer state between the input bytes. */
+enum lex_state {
+	/** Whitespaces before a token. */
+	LEX_STATE_SPACE,
+	LEX_STATE_WORD,
+	/** After a backslash outside of quotes. */
+	LEX_STATE_ESCAPE,
+	/** After a backslash in double quotes. */
+	LEX_STATE_QUOTE_ESCAPE,
+	/** After the first char of an operator, it can be doubled. */
+	LEX_STATE_OPERATOR,
+	LEX_STATE_COMMENT,
+	/** After '$', it starts a substitution if '(' follows. */
+	LEX_STATE_DOLLAR,
+	/** Inside $(), till the matching ')'. */
+	LEX_STATE_SUBST,
+};
+
+/** Which tokens the line being built expects next. */
+enum line_state {
+	/** Commands and operators between them. */
+	LINE_STATE_EXPRS,
+	/** After an output redirect, a file name. */
+	LINE_STATE_OUT_FILE,
+	/** After the file name, '&' or the line end. */
+	LINE_STATE_OUT_DONE,
+	/**
+	 * After an input redirect, a file name or a here-document
+	 * delimiter. Then the commands go on.
+	 */
+	LINE_STATE_IN_FILE,
+	/** After '&', the line end. */
+	LINE_STATE_BACKGROUND,
+	/** The line has an error, it is skipped till the end. */
+	LINE_STATE_ERROR,
+};
+
+struct parser {
+	/**
+	 * Own copy of the input. Not parsed yet data is [begin, end),
+	 * consumed lines only move begin.
+	 */
+	char *buffer;
+	uint32_t begin;
+	uint32_t end;
+	uint32_t capacity;
+	/**
+	 * Data fed by reference. It is parsed in place, the not parsed
+	 * rest is copied into the buffer when the caller gets no line.
+	 */
+	const char *ref;
+	uint32_t ref_size;
+	/**
+	 * The parsing state is kept between the feeds, so each byte
+	 * is scanned once. Scanned bytes of the not consumed input.
+	 */
+	uint32_t scanned;
+	enum lex_state lex;
+	/** Open quote of the current token, or 0. */
+	char quote;
+	/** First char of the current operator. */
+	char op;
+	/**
+	 * State of the substitution being scanned: its open parentheses,
+	 * open quote and whether a backslash was before.
+	 */
+	uint32_t subst_depth;
+	char subst_quote;
+	bool subst_escape;
+	struct token token;
+	/** The line being built, NULL before its first token. */
+	struct command_line *line;
+	enum line_state state;
+	/** Error of the line, reported when it ends. */
+	enum parser_error error;
+	/** The line has ended, its here-document is being read. */
+	bool in_heredoc;
+	/** Allocated size of the here-document in the line. */
+	uint32_t heredoc_capacity;
+};
+
+
+/**
+ * All the memory of a command line: the line itself, its exprs,
+ * arguments and strings, is bump allocated in chunks. The line is at
+ * the start of the first chunk, which fits most of the lines, so
+ * deletion is usually a single free.
+ */
+struct line_chunk {
+	/** Next chunks. The first of them is the current one. */
+	struct line_chunk *next;
+	uint32_t size;
+	uint32_t used;
+	_Alignas(16) char data[];
+};
+
+enum {
+	LINE_CHUNK_SIZE = 1024,
+	LINE_ALIGN = 16,
+};
+
+static struct line_chunk *
+line_chunk_new(uint32_t size)
+{
+	struct line_chunk *c = malloc(sizeof(*c) + size);
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static struct line_chunk *
+line_first_chunk(struct command_line *line)
+{
+	return (struct line_chunk *)((char *)line -
+				     offsetof(struct line_chunk, data));
+}
+
+static struct line_chunk *
+line_current_chunk(struct command_line *line)
+{
+	struct line_chunk *first = line_first_chunk(line);
+	return first->next != NULL ? first->next : first;
+}
+
+static void *
+line_alloc(struct command_line *line, uint32_t size)
+{
+	size = (size + LINE_ALIGN - 1) & ~(uint32_t)(LINE_ALIGN - 1);
+	struct line_chunk *c = line_current_chunk(line);
+	if (c->size - c->used < size) {
+		struct line_chunk *first = line_first_chunk(line);
+		uint32_t chunk_size = c->size * 2;
+		if (chunk_size < size)
+			chunk_size = size;
+		c = line_chunk_new(chunk_size);
+		c->next = first->next;
+		first->next = c;
+	}
+	void *res = c->data + c->used;
+	c->used += size;
+	return res;
+}
+
+/**
+ * Grow an allocation. The last allocation of the current chunk grows
+ * in place, others are copied.
+ */
+static void *
+line_realloc(struct command_line *line, void *ptr, uint32_t old_size,
+	     uint32_t new_size)
+{
+	struct line_chunk *c = line_current_chunk(line);
+	old_size = (old_size + LINE_ALIGN - 1) & ~(uint32_t)(LINE_ALIGN - 1);
+	new_size = (new_size + LINE_ALIGN - 1) & ~(uint32_t)(LINE_ALIGN - 1);
+	if (ptr != NULL && (char *)ptr + old_size == c->data + c->used &&
+	    c->used - old_size + new_size <= c->size) {
+		c->used = c->used - old_size + new_size;
+		return ptr;
+	}
+	void *res = line_alloc(line, new_size);
+	if (ptr != NULL)
+		memcpy(res, ptr, old_size);
+	return res;
+}
+
+static struct command_line *
+command_line_new(void)
+{
+	struct line_chunk *c = line_chunk_new(LINE_CHUNK_SIZE);
+	struct command_line *line = (struct command_line *)c->data;
+	c->used = (sizeof(*line) + LINE_ALIGN - 1) & ~(LINE_ALIGN - 1);
+	memset(line, 0, sizeof(*line));
+	return line;
+}
+
+void *
+command_line_alloc(struct command_line *line, uint32_t size)
+{
+	return line_alloc(line, size);
+}
+
+/** The text of a string token, which is empty for "" or for $(). */
+static char *
+line_strdup(struct command_line *line, const struct token *t,
+	    const char *input)
+{
+	assert(t->type == TOKEN_TYPE_STR);
+	char *res = line_alloc(line, t->size + 1);
+	if (t->size > 0)
+		memcpy(res, token_text(t, input), t->size);
+	res[t->size] = 0;
+	return res;
+}
+
+static struct expr *
+line_new_expr(struct command_line *line, enum expr_type type)
+{
+	struct expr *e = line_alloc(line, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		uint32_t capacity = (cmd->arg_capacity + 1) * 2;
+		cmd->args = line_realloc(line, cmd->args,
+					 sizeof(*cmd->args) * cmd->arg_capacity,
+					 sizeof(*cmd->args) * capacity);
+		cmd->arg_capacity = capacity;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
 	cmd->args[cmd->arg_count++] = arg;
 }
 
+/** Copy the substitutions of the token into the word of the command. */
+static void
+command_add_substs(struct command_line *line, struct command *cmd,
+		   uint32_t word, const struct token *t)
+{
+	for (uint32_t i = 0; i < t->subst_count; ++i) {
+		const struct token_subst *ts = &t->substs[i];
+		if (cmd->subst_count == cmd->subst_capacity) {
+			uint32_t capacity = (cmd->subst_capacity + 1) * 2;
+			cmd->substs = line_realloc(line, cmd->substs,
+				sizeof(*cmd->substs) * cmd->subst_capacity,
+				sizeof(*cmd->substs) * capacity);
+			cmd->subst_capacity = capacity;
+		}
+		struct subst *s = &cmd->substs[cmd->subst_count++];
+		s->word = word;
+		s->offset = ts->offset;
+		s->is_quoted = ts->is_quoted;
+		const char *text = t->subst_text + ts->text_start;
+		uint32_t len = strlen(text);
+		s->text = line_alloc(line, len + 1);
+		memcpy(s->text, text, len + 1);
+	}
+}
+
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	struct line_chunk *first = line_first_chunk(line);
+	while (first->next != NULL) {
+		struct line_chunk *c = first->next;
+		first->next = c->next;
+		free(c);
 	}
-	free(line->out_file);
-	free(line);
+	free(first);
 }
 
 static void
@@ -107,336 +432,652 @@ parser_new(void)
 	return calloc(1, sizeof(struct parser));
 }
 
-void
-parser_feed(struct parser *p, const char *str, uint32_t len)
+/**
+ * Make room for len more bytes at the end of the buffer. The data is
+ * moved to the front only when the consumed space is not smaller than
+ * the data, so each byte is moved O(1) times on average.
+ */
+static void
+parser_reserve(struct parser *p, uint32_t len)
 {
-	uint32_t cap = p->capacity - p->size;
-	if (cap < len) {
+	if (p->capacity - p->end >= len)
+		return;
+	uint32_t size = p->end - p->begin;
+	if (p->begin >= size && p->capacity - size >= len) {
+		memmove(p->buffer, p->buffer + p->begin, size);
+	} else {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
+		if (new_capacity - size < len)
+			new_capacity = size + len;
+		char *buffer = malloc(sizeof(*buffer) * new_capacity);
+		if (size > 0)
+			memcpy(buffer, p->buffer + p->begin, size);
+		free(p->buffer);
+		p->buffer = buffer;
 		p->capacity = new_capacity;
 	}
-	memcpy(p->buffer + p->size, str, len);
-	p->size += len;
-	assert(p->size <= p->capacity);
+	p->begin = 0;
+	p->end = size;
+}
+
+static void
+parser_append(struct parser *p, const char *str, uint32_t len)
+{
+	parser_reserve(p, len);
+	if (len > 0)
+		memcpy(p->buffer + p->end, str, len);
+	p->end += len;
+	assert(p->end <= p->capacity);
+}
+
+/** Copy the not parsed rest of the referenced data. */
+static void
+parser_detach_ref(struct parser *p)
+{
+	if (p->ref == NULL)
+		return;
+	assert(p->begin == p->end);
+	parser_append(p, p->ref, p->ref_size);
+	p->ref = NULL;
+	p->ref_size = 0;
+}
+
+void
+parser_feed(struct parser *p, const char *str, uint32_t len)
+{
+	parser_detach_ref(p);
+	parser_append(p, str, len);
+}
+
+void
+parser_feed_ref(struct parser *p, const char *str, uint32_t len)
+{
+	if (p->ref != NULL || p->begin != p->end) {
+		/* Has to be contiguous with the previous data. */
+		parser_feed(p, str, len);
+		return;
+	}
+	p->ref = str;
+	p->ref_size = len;
+}
+
+static void
+parser_input(const struct parser *p, const char **pos, const char **end)
+{
+	if (p->ref != NULL) {
+		*pos = p->ref;
+		*end = p->ref + p->ref_size;
+	} else {
+		*pos = p->buffer + p->begin;
+		*end = p->buffer + p->end;
+	}
 }
 
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
-		p->size = 0;
+	if (p->ref != NULL) {
+		assert(p->ref_size >= size);
+		p->ref += size;
+		p->ref_size -= size;
 		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+	assert(p->end - p->begin >= size);
+	p->begin += size;
+	if (p->begin == p->end) {
+		p->begin = 0;
+		p->end = 0;
+	}
 }
 
+/**
+ * Length of the span of chars which are just appended to a word. The
+ * span ends before any char which can need a special handling: quotes,
+ * backslash, operators, comment and whitespaces. Control chars stop it
+ * too, they are rare and are handled one by one.
+ */
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+scan_word(const char *pos, const char *end)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i dquote = _mm_set1_epi8('"');
+	const __m128i squote = _mm_set1_epi8('\'');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i bar = _mm_set1_epi8('|');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i dollar = _mm_set1_epi8('$');
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		/* c <= ' ' as unsigned. */
+		__m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, space), space);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dquote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, squote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, amp));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bar));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, gt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, hash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dollar));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	for (; pos < end; ++pos) {
+		unsigned char c = *pos;
+		if (c <= ' ' || c == '"' || c == '\'' || c == '\\' ||
+		    c == '&' || c == '|' || c == '>' || c == '<' || c == '#' ||
+		    c == '$')
 			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
-		++pos;
 	}
-	char quote = 0;
+	return pos - begin;
+}
+
+/**
+ * Length of the span of chars in quotes before the closing quote or a
+ * backslash, or a '$' in double quotes.
+ */
+static uint32_t
+scan_quoted(const char *pos, const char *end, char quote)
+{
+	const char *begin = pos;
+	/* In single quotes it is just one more quote to look for. */
+	char dollar = quote == '"' ? '$' : quote;
+#ifdef __SSE2__
+	const __m128i q = _mm_set1_epi8(quote);
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i d = _mm_set1_epi8(dollar);
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, q),
+					 _mm_cmpeq_epi8(v, backslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, d));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != quote && *pos != '\\' && *pos != dollar)
+		++pos;
+	return pos - begin;
+}
+
+/**
+ * Scan the input from where the previous call has stopped. True, if a
+ * token is complete, it is in p->token. Otherwise all the input is
+ * scanned, the state is kept till the next feed.
+ */
+static bool
+parser_next_token(struct parser *p, const char *input, const char *end)
+{
+	struct token *t = &p->token;
+	const char *pos = input + p->scanned;
+	if (p->lex == LEX_STATE_SPACE)
+		token_reset(t);
 	while (pos < end) {
 		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
-				++pos;
-				if (pos == end)
-					return 0;
-				continue;
-			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
+		switch (p->lex) {
+		case LEX_STATE_SPACE:
+			if (c == '\n') {
 				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
+				t->type = TOKEN_TYPE_NEW_LINE;
+				goto token_done;
 			}
-			assert(quote == 0);
-			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
+			if (isspace(c)) {
 				++pos;
 				continue;
 			}
-			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
+			t->start = pos - input;
+			p->lex = LEX_STATE_WORD;
+			continue;
+		case LEX_STATE_ESCAPE:
 			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
+			p->lex = LEX_STATE_WORD;
+			if (c != '\n')
+				token_append(t, c);
+			continue;
+		case LEX_STATE_QUOTE_ESCAPE:
+			++pos;
+			p->lex = LEX_STATE_WORD;
+			if (c == '\n')
+				continue;
+			if (c != '\\' && c != '"' && c != '$')
+				token_append(t, '\\');
+			token_append(t, c);
+			continue;
+		case LEX_STATE_OPERATOR:
+			if (c == p->op) {
+				++pos;
+				switch (c) {
 				case '&':
-					out->type = TOKEN_TYPE_AND;
+					t->type = TOKEN_TYPE_AND;
 					break;
 				case '|':
-					out->type = TOKEN_TYPE_OR;
+					t->type = TOKEN_TYPE_OR;
 					break;
 				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
+					t->type = TOKEN_TYPE_OUT_APPEND;
+					break;
+				case '<':
+					t->type = TOKEN_TYPE_HEREDOC;
 					break;
 				default:
 					assert(false);
 					break;
 				}
-				++pos;
 			} else {
-				switch(c) {
+				switch (p->op) {
 				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
+					t->type = TOKEN_TYPE_BACKGROUND;
 					break;
 				case '|':
-					out->type = TOKEN_TYPE_PIPE;
+					t->type = TOKEN_TYPE_PIPE;
 					break;
 				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
+					t->type = TOKEN_TYPE_OUT_NEW;
+					break;
+				case '<':
+					t->type = TOKEN_TYPE_IN;
 					break;
 				default:
 					assert(false);
 					break;
 				}
 			}
-			return pos - begin;
-		case ' ':
-		case '\t':
-		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
-		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			goto token_done;
+		case LEX_STATE_COMMENT:
+			pos = memchr(pos, '\n', end - pos);
+			if (pos == NULL) {
+				pos = end;
+				continue;
 			}
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
-		default:
-			goto append_and_next;
-		}
-	append_and_next:
-		token_append(out, c);
-		++pos;
-	}
-	return 0;
-}
-
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
-{
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
-
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+			t->type = TOKEN_TYPE_NEW_LINE;
+			goto token_done;
+		case LEX_STATE_DOLLAR:
+			p->lex = LEX_STATE_WORD;
+			if (c != '(') {
+				/* Just a char, it is right after the slice. */
+				token_append(t, '$');
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
+			++pos;
+			token_decode(t, input);
+			token_start_subst(t, p->quote == '"');
+			p->subst_depth = 1;
+			p->subst_quote = 0;
+			p->subst_escape = false;
+			p->lex = LEX_STATE_SUBST;
 			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
+		case LEX_STATE_SUBST:
+			++pos;
+			if (p->subst_escape) {
+				p->subst_escape = false;
+			} else if (c == '\\' && p->subst_quote != '\'') {
+				p->subst_escape = true;
+			} else if (p->subst_quote != 0) {
+				if (c == p->subst_quote)
+					p->subst_quote = 0;
+			} else if (c == '\'' || c == '"') {
+				p->subst_quote = c;
+			} else if (c == '(') {
+				++p->subst_depth;
+			} else if (c == ')' && --p->subst_depth == 0) {
+				token_append_subst_char(t, 0);
+				p->lex = LEX_STATE_WORD;
 				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
+			token_append_subst_char(t, c);
 			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
+		case LEX_STATE_WORD:
+			break;
+		}
+		/* Plain chars are appended in bulk. */
+		uint32_t span = p->quote == 0 ? scan_word(pos, end) :
+			scan_quoted(pos, end, p->quote);
+		if (span > 0) {
+			token_append_span(t, pos, span);
+			pos += span;
+			continue;
+		}
+		switch (c) {
+		case '\'':
+		case '"':
+			if (p->quote == 0) {
+				token_decode(t, input);
+				p->quote = c;
+				++pos;
+				continue;
 			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+			if (p->quote != c)
+				break;
+			p->quote = 0;
+			++pos;
+			t->type = TOKEN_TYPE_STR;
+			goto token_done;
+		case '$':
+			if (p->quote == '\'')
+				break;
+			p->lex = LEX_STATE_DOLLAR;
+			++pos;
+			continue;
+		case '\\':
+			if (p->quote == '\'')
+				break;
+			token_decode(t, input);
+			if (p->quote == '"')
+				p->lex = LEX_STATE_QUOTE_ESCAPE;
+			else
+				p->lex = LEX_STATE_ESCAPE;
+			++pos;
+			continue;
+		case '&':
+		case '|':
+		case '>':
+		case '<':
+			if (p->quote != 0)
+				break;
+			if (!token_is_empty(t)) {
+				t->type = TOKEN_TYPE_STR;
+				goto token_done;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
+			p->op = c;
+			p->lex = LEX_STATE_OPERATOR;
+			++pos;
 			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			if (p->quote != 0)
+				break;
+			if (token_is_empty(t)) {
+				/* Only an escaped line end was here. */
+				token_reset(t);
+				p->lex = LEX_STATE_SPACE;
+				continue;
 			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+			/* The line end is a token itself. */
+			if (c != '\n')
+				++pos;
+			t->type = TOKEN_TYPE_STR;
+			goto token_done;
+		case '#':
+			if (p->quote != 0)
+				break;
+			if (!token_is_empty(t)) {
+				t->type = TOKEN_TYPE_STR;
+				goto token_done;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
+			p->lex = LEX_STATE_COMMENT;
+			++pos;
 			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
 		default:
-			assert(false);
+			break;
 		}
+		token_append(t, c);
+		++pos;
 	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+	p->scanned = pos - input;
+	return false;
+
+token_done:
+	p->scanned = pos - input;
+	p->lex = LEX_STATE_SPACE;
+	return true;
+}
+
+static void
+parser_set_error(struct parser *p, enum parser_error err)
+{
+	p->state = LINE_STATE_ERROR;
+	p->error = err;
+}
+
+/** Add a complete token, except the line end, to the line. */
+static void
+parser_add_token(struct parser *p, const char *input)
+{
+	struct command_line *line = p->line;
+	const struct token *t = &p->token;
+	struct expr *e;
+	switch (p->state) {
+	case LINE_STATE_EXPRS:
+		break;
+	case LINE_STATE_OUT_FILE:
+		if (t->type != TOKEN_TYPE_STR || t->subst_count > 0) {
+			parser_set_error(p, PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+			return;
+		}
+		line->out_file = line_strdup(line, t, input);
+		p->state = LINE_STATE_OUT_DONE;
+		return;
+	case LINE_STATE_OUT_DONE:
+		if (t->type != TOKEN_TYPE_BACKGROUND) {
+			parser_set_error(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+			return;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		p->state = LINE_STATE_BACKGROUND;
+		return;
+	case LINE_STATE_IN_FILE:
+		if (t->type != TOKEN_TYPE_STR || t->subst_count > 0) {
+			parser_set_error(p, PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+			return;
+		}
+		line->in_file = line_strdup(line, t, input);
+		p->state = LINE_STATE_EXPRS;
+		return;
+	case LINE_STATE_BACKGROUND:
+		parser_set_error(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+		return;
+	case LINE_STATE_ERROR:
+		return;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
+	switch (t->type) {
+	case TOKEN_TYPE_STR:
+		if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
+			struct command *cmd = &line->tail->cmd;
+			command_add_substs(line, cmd, cmd->arg_count + 1, t);
+			command_append_arg(line, cmd, line_strdup(line, t, input));
+			return;
+		}
+		e = line_new_expr(line, EXPR_TYPE_COMMAND);
+		e->cmd.exe = line_strdup(line, t, input);
+		command_add_substs(line, &e->cmd, 0, t);
+		command_line_append(line, e);
+		return;
+	case TOKEN_TYPE_PIPE:
+		if (line->tail == NULL) {
+			parser_set_error(p, PARSER_ERR_PIPE_WITH_NO_LEFT_ARG);
+			return;
+		}
+		if (line->tail->type != EXPR_TYPE_COMMAND) {
+			parser_set_error(p, PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return;
+		}
+		command_line_append(line, line_new_expr(line, EXPR_TYPE_PIPE));
+		return;
+	case TOKEN_TYPE_AND:
+		if (line->tail == NULL) {
+			parser_set_error(p, PARSER_ERR_AND_WITH_NO_LEFT_ARG);
+			return;
+		}
+		if (line->tail->type != EXPR_TYPE_COMMAND) {
+			parser_set_error(p, PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return;
+		}
+		command_line_append(line, line_new_expr(line, EXPR_TYPE_AND));
+		return;
+	case TOKEN_TYPE_OR:
+		if (line->tail == NULL) {
+			parser_set_error(p, PARSER_ERR_OR_WITH_NO_LEFT_ARG);
+			return;
+		}
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+			parser_set_error(p, PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		command_line_append(line, line_new_expr(line, EXPR_TYPE_OR));
+		return;
+	case TOKEN_TYPE_OUT_NEW:
+		line->out_type = OUTPUT_TYPE_FILE_NEW;
+		p->state = LINE_STATE_OUT_FILE;
+		return;
+	case TOKEN_TYPE_OUT_APPEND:
+		line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		p->state = LINE_STATE_OUT_FILE;
+		return;
+	case TOKEN_TYPE_IN:
+	case TOKEN_TYPE_HEREDOC:
+		/* Only the first command reads the line's input. */
+		if (line->tail == NULL || line->tail != line->head ||
+		    line->in_type != INPUT_TYPE_STDIN) {
+			parser_set_error(p, PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+			return;
+		}
+		line->in_type = t->type == TOKEN_TYPE_IN ? INPUT_TYPE_FILE :
+			INPUT_TYPE_HEREDOC;
+		p->state = LINE_STATE_IN_FILE;
+		return;
+	case TOKEN_TYPE_BACKGROUND:
+		line->is_background = true;
+		p->state = LINE_STATE_BACKGROUND;
+		return;
+	default:
+		assert(false);
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
+}
 
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
+/** The line has ended, take it from the parser and check it. */
+static enum parser_error
+parser_end_line(struct parser *p, struct command_line **out)
+{
+	struct command_line *line = p->line;
+	enum parser_error res = p->error;
+	if (res == PARSER_ERR_NONE && p->state == LINE_STATE_OUT_FILE)
+		res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+	if (res == PARSER_ERR_NONE && p->state == LINE_STATE_IN_FILE)
+		res = PARSER_ERR_INPUT_REDIRECT_BAD_ARG;
+	if (res == PARSER_ERR_NONE &&
+	    (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND))
+		res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	p->line = NULL;
+	p->state = LINE_STATE_EXPRS;
+	p->error = PARSER_ERR_NONE;
+	p->in_heredoc = false;
+	p->heredoc_capacity = 0;
+	if (res != PARSER_ERR_NONE) {
+		command_line_delete(line);
+		return res;
+	}
+	*out = line;
+	return PARSER_ERR_NONE;
+}
+
+static void
+parser_append_heredoc(struct parser *p, const char *str, uint32_t len)
+{
+	struct command_line *line = p->line;
+	if (line->in_size + len > p->heredoc_capacity) {
+		uint32_t capacity = (p->heredoc_capacity + 1) * 2;
+		if (capacity < line->in_size + len)
+			capacity = line->in_size + len;
+		line->in_data = line_realloc(line, line->in_data,
+					     p->heredoc_capacity, capacity);
+		p->heredoc_capacity = capacity;
+	}
+	memcpy(line->in_data + line->in_size, str, len);
+	line->in_size += len;
+}
+
+/**
+ * Read the here-document of the ended line. The lines are taken as is,
+ * without any tokens, till the one equal to the delimiter. True, if it
+ * is found. Otherwise the complete lines are consumed, the incomplete
+ * one waits for the next feed.
+ */
+static bool
+parser_read_heredoc(struct parser *p, const char *input, const char *end)
+{
+	const char *delim = p->line->in_file;
+	uint32_t delim_len = strlen(delim);
+	const char *pos = input;
+	bool is_found = false;
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
+		const char *eol = memchr(pos, '\n', end - pos);
+		if (eol == NULL)
+			break;
+		if ((uint32_t)(eol - pos) == delim_len &&
+		    memcmp(pos, delim, delim_len) == 0) {
+			is_found = true;
 			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
 		}
+		pos = eol + 1;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+	/* The body lines are copied at once. */
+	if (pos > input)
+		parser_append_heredoc(p, input, pos - input);
+	if (is_found)
+		pos += delim_len + 1;
+	parser_consume(p, pos - input);
+	return is_found;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
 	*out = NULL;
-
-return_final:
-	free(token.data);
-	return res;
+	while (true) {
+		const char *input;
+		const char *end;
+		parser_input(p, &input, &end);
+		if (p->in_heredoc) {
+			if (!parser_read_heredoc(p, input, end))
+				break;
+			return parser_end_line(p, out);
+		}
+		if (!parser_next_token(p, input, end))
+			break;
+		if (p->token.type != TOKEN_TYPE_NEW_LINE) {
+			if (p->line == NULL)
+				p->line = command_line_new();
+			parser_add_token(p, input);
+			continue;
+		}
+		parser_consume(p, p->scanned);
+		p->scanned = 0;
+		/* Skip empty lines. */
+		if (p->line == NULL)
+			continue;
+		if (p->line->in_type == INPUT_TYPE_HEREDOC &&
+		    p->line->in_file != NULL) {
+			p->in_heredoc = true;
+			continue;
+		}
+		return parser_end_line(p, out);
+	}
+	/* The caller is going to feed more data. */
+	parser_detach_ref(p);
+	return PARSER_ERR_NONE;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	if (p->line != NULL)
+		command_line_delete(p->line);
+	free(p->token.data);
+	free(p->token.substs);
+	free(p->token.subst_text);
 	free(p->buffer);
 	free(p);
 }
@@ -16,6 +16,20 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_INPUT_REDIRECT_BAD_ARG,
+	PARSER_ERR_INPUT_REDIRECT_NOT_FIRST,
+};
+
+/** Command substitution, $(...) in a word. */
+struct subst {
+	/** Index of the word: 0 is the exe, then the args. */
+	uint32_t word;
+	/** Where the output goes into the word. */
+	uint32_t offset;
+	/** The commands inside the parentheses, they are parsed when run. */
+	char *text;
+	/** In double quotes the output is not split into words. */
+	bool is_quoted;
 };
 
 struct command {
@@ -23,6 +37,10 @@ struct command {
 	char** args;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
+	/** Substitutions of all the words, in their order. */
+	struct subst *substs;
+	uint32_t subst_count;
+	uint32_t subst_capacity;
 };
 
 enum expr_type {
@@ -45,24 +63,52 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+enum input_type {
+	INPUT_TYPE_STDIN,
+	INPUT_TYPE_FILE,
+	INPUT_TYPE_HEREDOC,
+};
+
 struct command_line {
 	struct expr *head;
 	struct expr *tail;
 	enum output_type out_type;
 	/** Valid if the out type is FILE. */
 	char *out_file;
+	/** Stdin of the first command. */
+	enum input_type in_type;
+	/** The file name, or the delimiter of the here-document. */
+	char *in_file;
+	/**
+	 * Valid if the in type is HEREDOC. The lines after the command
+	 * line till the delimiter, with their line ends.
+	 */
+	char *in_data;
+	uint32_t in_size;
 	bool is_background;
 };
 
 void
 command_line_delete(struct command_line *line);
 
+/** Allocate memory which is freed together with the line. */
+void *
+command_line_alloc(struct command_line *line, uint32_t size);
+
 struct parser *
 parser_new(void);
 
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Feed the data without copying. It must stay valid and unchanged
+ * until parser_pop_next() returns no line and no error. The part of it
+ * which is not parsed by then is copied.
+ */
+void
+parser_feed_ref(struct parser *p, const char *str, uint32_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
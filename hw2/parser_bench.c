@@ -0,0 +1,114 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Parser throughput on generated scripts. The script is fed by chunks
+ * like the shell reads stdin, and all the lines are popped.
+ */
+
+struct script {
+	const char *name;
+	/** Lines the script is made of, repeated till the size. */
+	const char **lines;
+};
+
+static const char *short_lines[] = {
+	"ls -l /tmp\n",
+	"echo hello world\n",
+	"cat file.txt | grep pattern | wc -l\n",
+	"mkdir -p dir && cd dir || exit 1\n",
+	"true\n",
+	NULL,
+};
+
+static const char *long_lines[] = {
+	"gcc -Wall -Wextra -Werror -O2 -I../utils -I/usr/local/include/project "
+	"parser.c solution.c ../utils/heap_help/heap_help.c -o main_binary\n",
+	"find /usr/share/documentation/packages/some-long-package-name "
+	"-name configuration_file_with_a_long_name.conf >> output_file.log\n",
+	NULL,
+};
+
+static const char *quoted_lines[] = {
+	"echo 'a string in single quotes' \"and one in double quotes\"\n",
+	"printf \"%s\\n\" \"escaped \\\"quotes\\\" and \\\\ backslash\" \\\n"
+	"  'continued line' # and a comment\n",
+	NULL,
+};
+
+static const struct script scripts[] = {
+	{"short commands", short_lines},
+	{"long arguments", long_lines},
+	{"quotes and escapes", quoted_lines},
+};
+
+static char *
+script_generate(const struct script *s, size_t size, size_t *len)
+{
+	char *buf = malloc(size + 1024);
+	size_t used = 0;
+	for (int i = 0; used < size; ++i) {
+		if (s->lines[i] == NULL)
+			i = 0;
+		size_t line_len = strlen(s->lines[i]);
+		memcpy(buf + used, s->lines[i], line_len);
+		used += line_len;
+	}
+	*len = used;
+	return buf;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const struct script *s, size_t size, size_t chunk)
+{
+	size_t len;
+	char *text = script_generate(s, size, &len);
+	struct parser *p = parser_new();
+	struct command_line *line;
+	enum parser_error err;
+	size_t lines = 0;
+	double start = now();
+	for (size_t pos = 0; pos < len; pos += chunk) {
+		size_t n = len - pos < chunk ? len - pos : chunk;
+		parser_feed_ref(p, text + pos, n);
+		while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE ||
+		       line != NULL) {
+			if (line == NULL)
+				continue;
+			++lines;
+			command_line_delete(line);
+		}
+	}
+	double time = now() - start;
+	parser_delete(p);
+	free(text);
+	printf("%-20s %6.1f MB in %.3f s, %7.1f MB/s, %.2f M lines/s\n",
+	       s->name, len / 1e6, time, len / 1e6 / time, lines / 1e6 / time);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = argc > 1 ? strtoull(argv[1], NULL, 10) << 20 : 64 << 20;
+	size_t chunk = argc > 2 ? strtoull(argv[2], NULL, 10) : 4096;
+	if (size == 0 || chunk == 0) {
+		fprintf(stderr, "Usage: %s [script size, MB] [chunk size, bytes]\n",
+			argv[0]);
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+		bench(&scripts[i], size, chunk);
+	return 0;
+}
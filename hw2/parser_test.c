@@ -2,6 +2,7 @@
 
 #include "unit.h"
 
+#include <stdio.h>
 #include <string.h>
 
 static void
@@ -279,6 +280,185 @@ test_output_redirect(void)
 	unit_test_finish();
 }
 
+static void
+test_input_redirect(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "sort -r < \"in file.txt\" | uniq > out.txt";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->in_type == INPUT_TYPE_FILE, "in type");
+	unit_check(strcmp(line->in_file, "in file.txt") == 0, "in file");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "sort") == 0, "exe");
+	unit_check(e->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "-r") == 0, "arg[0]");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "pipe");
+	e = e->next;
+	unit_check(strcmp(e->cmd.exe, "uniq") == 0, "exe");
+	command_line_delete(line);
+
+	unit_msg("No spaces, arguments after the file");
+	str = "grep<file -v x\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->in_type == INPUT_TYPE_FILE, "in type");
+	unit_check(strcmp(line->in_file, "file") == 0, "in file");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "grep") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[1], "x") == 0, "arg[1]");
+	command_line_delete(line);
+
+	unit_msg("Here-document");
+	str = "cat <<EOF > out.txt\n"
+		"a | b && c # not a comment\n"
+		"  EOF\n"
+		"\n"
+		"EOF\n"
+		"echo next\n";
+	len = strlen(str);
+	uint32_t i = 0;
+	line = NULL;
+	while (i < len && line == NULL) {
+		parser_feed(p, &str[i++], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	}
+	unit_check(line != NULL, "the line ends with the delimiter");
+	unit_check(line->in_type == INPUT_TYPE_HEREDOC, "in type");
+	unit_check(strcmp(line->in_file, "EOF") == 0, "delimiter");
+	const char *body = "a | b && c # not a comment\n  EOF\n\n";
+	unit_check(line->in_size == strlen(body) &&
+		   memcmp(line->in_data, body, line->in_size) == 0, "body");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(line->head == line->tail, "one command");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "the next line is not complete yet");
+	parser_feed(p, str + i, len - i);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "next line");
+	command_line_delete(line);
+
+	unit_msg("Empty here-document, quoted delimiter");
+	str = "wc -l << 'E O F'\nE O F\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->in_type == INPUT_TYPE_HEREDOC, "in type");
+	unit_check(strcmp(line->in_file, "E O F") == 0, "delimiter");
+	unit_check(line->in_size == 0, "empty body");
+	command_line_delete(line);
+
+	unit_msg("Big here-document");
+	parser_feed(p, "cat <<E\n", 8);
+	char chunk[100];
+	memset(chunk, 'x', sizeof(chunk) - 1);
+	chunk[sizeof(chunk) - 1] = '\n';
+	for (int i = 0; i < 1000; ++i) {
+		parser_feed(p, chunk, sizeof(chunk));
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "E\n", 2);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->in_size == 1000 * sizeof(chunk), "body size");
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i)
+		ok = memcmp(line->in_data + i * sizeof(chunk), chunk, sizeof(chunk)) == 0;
+	unit_check(ok, "body data");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_command_substitution(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo a$(ls -l | wc -l)b \"x $(pwd) y\" $(true)";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head == line->tail, "one command");
+	struct command *cmd = &line->head->cmd;
+	unit_check(strcmp(cmd->exe, "echo") == 0, "exe");
+	unit_check(cmd->arg_count == 3, "arg count");
+	unit_check(strcmp(cmd->args[0], "ab") == 0, "arg[0]");
+	unit_check(strcmp(cmd->args[1], "x  y") == 0, "arg[1]");
+	unit_check(strcmp(cmd->args[2], "") == 0, "arg[2]");
+	unit_check(cmd->subst_count == 3, "subst count");
+	struct subst *s = &cmd->substs[0];
+	unit_check(s->word == 1 && s->offset == 1 && !s->is_quoted, "subst[0]");
+	unit_check(strcmp(s->text, "ls -l | wc -l") == 0, "subst[0] text");
+	s = &cmd->substs[1];
+	unit_check(s->word == 2 && s->offset == 2 && s->is_quoted, "subst[1]");
+	unit_check(strcmp(s->text, "pwd") == 0, "subst[1] text");
+	s = &cmd->substs[2];
+	unit_check(s->word == 3 && s->offset == 0 && !s->is_quoted, "subst[2]");
+	unit_check(strcmp(s->text, "true") == 0, "subst[2] text");
+	command_line_delete(line);
+
+	unit_msg("Nested, parentheses in quotes");
+	str = "$(echo $(echo a) \")\" '(' \\)) x\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	cmd = &line->head->cmd;
+	unit_check(strcmp(cmd->exe, "") == 0, "exe");
+	unit_check(cmd->arg_count == 1, "arg count");
+	unit_check(cmd->subst_count == 1, "subst count");
+	unit_check(cmd->substs[0].word == 0, "subst word");
+	unit_check(strcmp(cmd->substs[0].text,
+		   "echo $(echo a) \")\" '(' \\)") == 0, "subst text");
+	command_line_delete(line);
+
+	unit_msg("Not substitutions");
+	str = "echo a$ '$(x)' \\$(y) $x \"\\$(z)\"\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	cmd = &line->head->cmd;
+	unit_check(cmd->subst_count == 0, "subst count");
+	unit_check(cmd->arg_count == 5, "arg count");
+	unit_check(strcmp(cmd->args[0], "a$") == 0, "arg[0]");
+	unit_check(strcmp(cmd->args[1], "$(x)") == 0, "arg[1]");
+	unit_check(strcmp(cmd->args[2], "$(y)") == 0, "arg[2]");
+	unit_check(strcmp(cmd->args[3], "$x") == 0, "arg[3]");
+	unit_check(strcmp(cmd->args[4], "$(z)") == 0, "arg[4]");
+	command_line_delete(line);
+
+	unit_msg("Multiline");
+	str = "echo $(echo a\necho b)\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	cmd = &line->head->cmd;
+	unit_check(cmd->subst_count == 1, "subst count");
+	unit_check(strcmp(cmd->substs[0].text, "echo a\necho b") == 0, "subst text");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_escape_outside_of_string(void)
 {
@@ -773,6 +953,211 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_long_line(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/* Does not fit into one chunk of the line memory. */
+	const uint32_t count = 500;
+	char buf[16];
+	parser_feed(p, "echo", 4);
+	for (uint32_t i = 0; i < count; ++i) {
+		int len = i % 2 == 0 ? sprintf(buf, " arg%u", i) :
+			  sprintf(buf, " 'a r\\g%u'", i);
+		parser_feed(p, buf, len);
+	}
+	parser_feed(p, " > out\\.txt\nls\n", 15);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	struct expr *e = line->head;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == count, "arg count");
+	unit_check(e->next == NULL, "no more exprs");
+
+	unit_msg("The line does not depend on the parser buffer");
+	struct command_line *next = NULL;
+	parser_feed(p, "pwd\n", 4);
+	unit_check(parser_pop_next(p, &next) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(next->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(next);
+	bool ok = true;
+	for (uint32_t i = 0; i < count && ok; ++i) {
+		if (i % 2 == 0)
+			sprintf(buf, "arg%u", i);
+		else
+			sprintf(buf, "a r\\g%u", i);
+		ok = strcmp(e->cmd.args[i], buf) == 0;
+	}
+	unit_check(ok, "args");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_ref(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	char buf[64];
+	strcpy(buf, "ls -l\npwd\necho 12");
+	parser_feed_ref(p, buf, strlen(buf));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	unit_check(strcmp(line->head->cmd.args[0], "-l") == 0, "arg[0]");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "pwd") == 0, "exe");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines yet");
+
+	unit_msg("The rest is copied, the data can be reused");
+	memset(buf, 'x', sizeof(buf));
+	strcpy(buf, "3 45\n");
+	parser_feed_ref(p, buf, strlen(buf));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "123") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "45") == 0, "arg[1]");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines yet");
+
+	unit_msg("Many lines, the buffer is reused");
+	for (int i = 0; i < 1000; ++i) {
+		int len = sprintf(buf, "echo %d\npw", i);
+		parser_feed(p, buf, len);
+		parser_feed(p, "d\n", 2);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL);
+		unit_fail_if(strcmp(line->head->cmd.exe, "echo") != 0);
+		sprintf(buf, "%d", i);
+		unit_fail_if(strcmp(line->head->cmd.args[0], buf) != 0);
+		command_line_delete(line);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL);
+		unit_fail_if(strcmp(line->head->cmd.exe, "pwd") != 0);
+		command_line_delete(line);
+	}
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+/** Print all the lines which can be popped now, errors included. */
+static void
+print_lines(struct parser *p, char *buf, size_t size)
+{
+	struct command_line *line;
+	enum parser_error err;
+	size_t len = 0;
+	while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE ||
+	       line != NULL) {
+		if (err != PARSER_ERR_NONE) {
+			len += snprintf(buf + len, size - len, "error %d\n", err);
+			continue;
+		}
+		for (struct expr *e = line->head; e != NULL; e = e->next) {
+			if (e->type != EXPR_TYPE_COMMAND) {
+				len += snprintf(buf + len, size - len, "<%d> ",
+						e->type);
+				continue;
+			}
+			len += snprintf(buf + len, size - len, "[%s]", e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+				len += snprintf(buf + len, size - len, "[%s]",
+						e->cmd.args[i]);
+			}
+			for (uint32_t i = 0; i < e->cmd.subst_count; ++i) {
+				const struct subst *s = &e->cmd.substs[i];
+				len += snprintf(buf + len, size - len,
+						"{%u %u %d %s}", s->word,
+						s->offset, s->is_quoted,
+						s->text);
+			}
+			len += snprintf(buf + len, size - len, " ");
+		}
+		len += snprintf(buf + len, size - len, "< %d %s %.*s",
+				line->in_type,
+				line->in_file != NULL ? line->in_file : "-",
+				(int)line->in_size,
+				line->in_data != NULL ? line->in_data : "");
+		len += snprintf(buf + len, size - len, "> %d %s %d\n",
+				line->out_type,
+				line->out_file != NULL ? line->out_file : "-",
+				line->is_background);
+		command_line_delete(line);
+	}
+	buf[len] = 0;
+}
+
+static void
+test_split_feeds(void)
+{
+	unit_test_start();
+
+	const char *str = "echo \"a\\\"b\\\nc\\d\" 'e\\f'g\\\nh \\\\ i#j\n"
+		"\n  # comment\n"
+		"x | y && z || w >> 'out file' &\n"
+		"x > && y\n"
+		"x & y\n"
+		"cat\\\n  file | wc -l > f\n"
+		"sort<in | uniq\n"
+		"cat <<EOF >> 'out file'\nbody | x\n\nEOF \nEOF\n"
+		"x | y < in\n"
+		"echo x$(a \"b)\" | c)y \"$(d $(e))\" $\n"
+		"printf 'a long string in single quotes \\ no escapes' "
+		"\"a long string in double quotes with \\\"escapes\\\" in it\" "
+		"a_very_long_word_without_any_delimiters_in_it|cat\n";
+	uint32_t len = strlen(str);
+	char expected[2048];
+	struct parser *p = parser_new();
+	parser_feed(p, str, len);
+	print_lines(p, expected, sizeof(expected));
+	parser_delete(p);
+	unit_msg("%s", expected);
+
+	unit_msg("Each split of the input gives the same lines");
+	char buf[2048];
+	char res[2048];
+	bool ok = true;
+	for (uint32_t i = 1; i < len && ok; ++i) {
+		p = parser_new();
+		parser_feed(p, str, i);
+		print_lines(p, res, sizeof(res));
+		parser_feed(p, str + i, len - i);
+		print_lines(p, buf, sizeof(buf));
+		strcat(res, buf);
+		parser_delete(p);
+		ok = strcmp(res, expected) == 0;
+	}
+	unit_check(ok, "two feeds");
+
+	unit_msg("Byte by byte");
+	p = parser_new();
+	res[0] = 0;
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, str + i, 1);
+		print_lines(p, buf, sizeof(buf));
+		strcat(res, buf);
+	}
+	parser_delete(p);
+	unit_check(strcmp(res, expected) == 0, "one byte feeds");
+
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -808,6 +1193,12 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "exe <", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe << |", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "< file exe", PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+	test_error_one(p, "exe | exe < file", PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+	test_error_one(p, "exe < a < b", PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+	test_error_one(p, "exe > $(x)", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -827,12 +1218,17 @@ main(void)
 	test_two_words();
 	test_escape_in_string();
 	test_output_redirect();
+	test_input_redirect();
+	test_command_substitution();
 	test_escape_outside_of_string();
 	test_pipe();
 	test_comments();
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_long_line();
+	test_feed_ref();
+	test_split_feeds();
 	test_errors();
 	return 0;
 }
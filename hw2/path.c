@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "builtin.h"
+#include "path.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct path_entry {
+	char *name;
+	char *path;
+	int hits;
+	struct path_entry *next;
+};
+
+// chained hash table, name -> path
+static struct {
+	struct path_entry **buckets;
+	size_t bucket_count;
+	size_t count;
+	// PATH the paths are found in
+	char *path_env;
+} cache;
+
+static uint32_t hash_name(const char *name) {
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static struct path_entry **find_entry(const char *name) {
+	if (cache.bucket_count == 0)
+		return NULL;
+	struct path_entry **pos = &cache.buckets[hash_name(name) % cache.bucket_count];
+	while (*pos != NULL && strcmp((*pos)->name, name) != 0)
+		pos = &(*pos)->next;
+	return pos;
+}
+
+static void insert_entry(struct path_entry *entry) {
+	if (cache.count >= cache.bucket_count) {
+		size_t bucket_count = cache.bucket_count == 0 ? 64 : cache.bucket_count * 2;
+		struct path_entry **buckets = calloc(bucket_count, sizeof(*buckets));
+		for (size_t i = 0; i < cache.bucket_count; ++i) {
+			while (cache.buckets[i] != NULL) {
+				struct path_entry *e = cache.buckets[i];
+				cache.buckets[i] = e->next;
+				size_t b = hash_name(e->name) % bucket_count;
+				e->next = buckets[b];
+				buckets[b] = e;
+			}
+		}
+		free(cache.buckets);
+		cache.buckets = buckets;
+		cache.bucket_count = bucket_count;
+	}
+	size_t b = hash_name(entry->name) % cache.bucket_count;
+	entry->next = cache.buckets[b];
+	cache.buckets[b] = entry;
+	cache.count++;
+}
+
+void path_clear(void) {
+	for (size_t i = 0; i < cache.bucket_count; ++i) {
+		while (cache.buckets[i] != NULL) {
+			struct path_entry *e = cache.buckets[i];
+			cache.buckets[i] = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+	}
+	free(cache.buckets);
+	free(cache.path_env);
+	cache.buckets = NULL;
+	cache.bucket_count = 0;
+	cache.count = 0;
+	cache.path_env = NULL;
+}
+
+void path_forget(const char *name) {
+	struct path_entry **pos = find_entry(name);
+	if (pos == NULL || *pos == NULL)
+		return;
+	struct path_entry *e = *pos;
+	*pos = e->next;
+	free(e->name);
+	free(e->path);
+	free(e);
+	cache.count--;
+}
+
+// looks the command up in PATH like execvp does, the empty directory is
+// the current one
+static char *search_path(const char *name, const char *path_env) {
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	while (true) {
+		const char *end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		char *path = malloc(dir_len + name_len + 2);
+		if (dir_len == 0) {
+			memcpy(path, name, name_len + 1);
+		} else {
+			memcpy(path, dir, dir_len);
+			path[dir_len] = '/';
+			memcpy(path + dir_len + 1, name, name_len + 1);
+		}
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (*end == 0)
+			return NULL;
+		dir = end + 1;
+	}
+}
+
+const char *path_resolve(const char *name) {
+	if (strchr(name, '/') != NULL)
+		return name;
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		path_env = "/bin:/usr/bin";
+	if (cache.path_env != NULL && strcmp(cache.path_env, path_env) != 0)
+		path_clear();
+	if (cache.path_env == NULL)
+		cache.path_env = strdup(path_env);
+	struct path_entry **pos = find_entry(name);
+	if (pos != NULL && *pos != NULL) {
+		(*pos)->hits++;
+		return (*pos)->path;
+	}
+	char *path = search_path(name, path_env);
+	if (path == NULL)
+		return NULL;
+	struct path_entry *e = malloc(sizeof(*e));
+	e->name = strdup(name);
+	e->path = path;
+	e->hits = 1;
+	insert_entry(e);
+	return path;
+}
+
+void path_print(struct out_buf *out) {
+	char buf[32];
+	if (cache.count != 0)
+		out_buf_append(out, "hits\tcommand\n", 13);
+	for (size_t i = 0; i < cache.bucket_count; ++i) {
+		for (struct path_entry *e = cache.buckets[i]; e != NULL; e = e->next) {
+			int len = snprintf(buf, sizeof(buf), "%4d\t", e->hits);
+			out_buf_append(out, buf, len);
+			out_buf_append(out, e->path, strlen(e->path));
+			out_buf_append(out, "\n", 1);
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+struct out_buf;
+
+// Cache of the command paths found in PATH, like the hash table of
+// other shells. A command is looked up in PATH once, the next runs
+// execve() its path right away instead of trying every directory.
+// The cache is dropped when PATH changes.
+
+// returns the path of the command or NULL if it is not found
+// a name with a slash is returned as is
+const char *path_resolve(const char *name);
+
+// drops the cached path, when it has turned out not to exist anymore
+void path_forget(const char *name);
+
+// drops all the cached paths
+void path_clear(void);
+
+// prints the cached paths and their hit counts, nothing if there is none
+void path_print(struct out_buf *out);
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+
+// Throughput of the ways the shell can move data into a pipe. First a
+// process writes into a pipe of different sizes, like yes | head.
+// Then a file is copied into a pipe like an in-shell cat does it: with
+// read() and write(), with splice() and with sendfile(). A child reads
+// the pipe and throws the data away in every case.
+// The shells given after the pipe sizes, like ./main and a build of the
+// baseline, run the same through their own pipelines: yes | head -c and
+// cat of the file, as many times as it takes, into cat > /dev/null.
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum copy_mode {
+	COPY_WRITE,
+	COPY_READ_WRITE,
+	COPY_SPLICE,
+	COPY_SENDFILE,
+};
+
+static const char *mode_names[] = {
+	[COPY_WRITE] = "write",
+	[COPY_READ_WRITE] = "read+write",
+	[COPY_SPLICE] = "splice",
+	[COPY_SENDFILE] = "sendfile",
+};
+
+static char chunk[1 << 16];
+
+// writes size bytes into fd, from memory or from the file
+static void copy(enum copy_mode mode, int fd, int file, long long size) {
+	long long done = 0;
+	while (done < size) {
+		long long left = size - done;
+		ssize_t rc;
+		switch (mode) {
+		case COPY_WRITE:
+			rc = write(fd, chunk, left < (long long)sizeof(chunk) ? left : (long long)sizeof(chunk));
+			break;
+		case COPY_READ_WRITE:
+			rc = read(file, chunk, left < (long long)sizeof(chunk) ? left : (long long)sizeof(chunk));
+			if (rc > 0 && write(fd, chunk, rc) != rc)
+				rc = -1;
+			break;
+		case COPY_SPLICE:
+			rc = splice(file, NULL, fd, NULL, left < (1 << 20) ? left : (1 << 20), SPLICE_F_MOVE);
+			break;
+		case COPY_SENDFILE:
+			rc = sendfile(fd, file, NULL, left < (1 << 30) ? left : (1 << 30));
+			break;
+		}
+		if (rc < 0) {
+			perror(mode_names[mode]);
+			exit(1);
+		}
+		if (rc == 0)
+			lseek(file, 0, SEEK_SET);
+		done += rc;
+	}
+}
+
+// MB/s of moving size bytes through a pipe of pipe_size bytes
+static double bench(enum copy_mode mode, int file, long long size, int pipe_size) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) < 0) {
+		perror("F_SETPIPE_SZ");
+		exit(1);
+	}
+	lseek(file, 0, SEEK_SET);
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[1]);
+		static char buf[1 << 20];
+		while (read(fds[0], buf, sizeof(buf)) > 0)
+			;
+		_exit(0);
+	}
+	close(fds[0]);
+	copy(mode, fds[1], file, size);
+	close(fds[1]);
+	waitpid(pid, NULL, 0);
+	return size / (now() - start) / (1 << 20);
+}
+
+// MB/s of a shell running the line which moves size bytes
+static double bench_shell(const char *shell, const char *line, long long size) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(shell, shell, NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+	if (write(fds[1], line, strlen(line)) != (ssize_t)strlen(line)) {
+		perror("write");
+		exit(1);
+	}
+	close(fds[1]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s has failed on %s", shell, line);
+		exit(1);
+	}
+	return size / (now() - start) / (1 << 20);
+}
+
+int main(int argc, char **argv) {
+	long long size = (argc > 1 ? atoll(argv[1]) : 4) << 30;
+	const char *sizes = argc > 2 ? argv[2] : "64,256,1024";
+	if (size <= 0) {
+		fprintf(stderr, "Usage: %s [GB to move] [pipe sizes, KB, comma separated] [shells]\n",
+				argv[0]);
+		return 1;
+	}
+	memset(chunk, 'y', sizeof(chunk));
+	// a file of 64MB in the page cache, it is sent over and over
+	char name[] = "/tmp/pipe_bench_XXXXXX";
+	int file = mkstemp(name);
+	for (int i = 0; i < 1024; ++i) {
+		if (write(file, chunk, sizeof(chunk)) != sizeof(chunk)) {
+			perror("write");
+			return 1;
+		}
+	}
+	printf("%10s %12s %12s %12s %12s\n", "pipe, KB", "write, MB/s", "read+write", "splice", "sendfile");
+	char *list = strdup(sizes);
+	for (char *s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+		int pipe_size = atoi(s) << 10;
+		printf("%10d", pipe_size >> 10);
+		for (int mode = COPY_WRITE; mode <= COPY_SENDFILE; ++mode) {
+			printf(" %12.0f", bench(mode, file, size, pipe_size));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	free(list);
+
+	if (argc > 3) {
+		long long file_count = (size + (64 << 20) - 1) / (64 << 20);
+		char head_line[64];
+		snprintf(head_line, sizeof(head_line), "yes | head -c %lld | cat > /dev/null\n", size);
+		char *cat_line = malloc(file_count * (sizeof(name) + 1) + 32);
+		int len = sprintf(cat_line, "cat");
+		for (long long i = 0; i < file_count; ++i)
+			len += sprintf(cat_line + len, " %s", name);
+		sprintf(cat_line + len, " | cat > /dev/null\n");
+		printf("\n%16s %16s %16s\n", "shell", "yes|head, MB/s", "cat file, MB/s");
+		for (int i = 3; i < argc; ++i) {
+			const char *shell = strrchr(argv[i], '/');
+			printf("%16s", shell != NULL ? shell + 1 : argv[i]);
+			fflush(stdout);
+			printf(" %16.0f", bench_shell(argv[i], head_line, size));
+			fflush(stdout);
+			printf(" %16.0f\n", bench_shell(argv[i], cat_line, file_count * (64 << 20)));
+		}
+		free(cat_line);
+	}
+	unlink(name);
+	close(file);
+	return 0;
+}
@@ -0,0 +1,58 @@
+import argparse
+import os
+import resource
+import subprocess
+import sys
+import time
+
+parser = argparse.ArgumentParser(description = "Time the shell on a big "\
+					       "generated script")
+parser.add_argument('-e', type=str, default='./main', help='shell executable')
+parser.add_argument('--size', type=int, default=100, help='script size, MB')
+parser.add_argument('--file', type=str, default='/tmp/script_bench.sh',
+		    help='generated script, reused if exists')
+parser.add_argument('--repeat', type=int, default=3, help='runs of each mode')
+parser.add_argument('--modes', type=str, default='file,stdin',
+		    help='comma separated: file - script as an argument, stdin - piped')
+args = parser.parse_args()
+
+# Mostly comments, which are only parsed, and some lines of in-shell
+# commands with long arguments, so the time is parsing and not starting
+# processes.
+def generate(name, size):
+	comment = '# ' + 'x' * 98 + '\n'
+	command = 'true ' + ' '.join(['"arg {}"'.format(i) for i in range(16)]) + '\n'
+	block = comment * 15 + command
+	with open(name, 'w') as f:
+		for i in range(size * (1 << 20) // len(block)):
+			f.write(block)
+
+if not os.path.exists(args.file) or \
+   os.path.getsize(args.file) < args.size * (1 << 20) * 9 // 10:
+	generate(args.file, args.size)
+size_mb = os.path.getsize(args.file) / (1 << 20)
+
+def run(mode):
+	if mode == 'file':
+		cmd, stdin = [args.e, args.file], subprocess.DEVNULL
+	else:
+		cmd, stdin = [args.e], open(args.file, 'rb')
+	start = time.monotonic()
+	p = subprocess.Popen(cmd, stdin=stdin)
+	_, status, usage = os.wait4(p.pid, 0)
+	wall = time.monotonic() - start
+	if mode != 'file':
+		stdin.close()
+	if status != 0:
+		print('{} failed'.format(' '.join(cmd)))
+		sys.exit(1)
+	return wall, usage
+
+print('{:.0f} MB script'.format(size_mb))
+print('{:>6} {:>8} {:>8} {:>8} {:>8} {:>10}'.format('mode', 'wall, s', 'user, s',
+	'sys, s', 'MB/s', 'max RSS, MB'))
+for mode in args.modes.split(','):
+	for i in range(args.repeat):
+		wall, usage = run(mode)
+		print('{:>6} {:8.3f} {:8.3f} {:8.3f} {:8.0f} {:10.1f}'.format(mode, wall,
+			usage.ru_utime, usage.ru_stime, size_mb / wall, usage.ru_maxrss / 1024))
@@ -1,15 +1,36 @@
+#define _GNU_SOURCE
+#include "builtin.h"
+#include "jobs.h"
 #include "parser.h"
+#include "path.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 
+extern char **environ;
+
+// capacity of the pipes between commands, bigger than the default 64KB,
+// see pipe_bench
+#define PIPE_SIZE (256 * 1024)
+
 static char **build_argv(const struct command *cmd) {
 	char **argv = malloc((2 + cmd->arg_count) * sizeof(char *));
 	argv[0] = cmd->exe;
@@ -20,118 +41,646 @@ static char **build_argv(const struct command *cmd) {
 	return argv;
 }
 
-struct pq_node {
+static void move_pipe(int fd_l[2], int fd_r[2]) {
+	if (fd_r[0] != -1) {
+		close(fd_r[0]);
+	}	
+	fd_r[0] = fd_l[0];
+	fd_l[0] = -1;
+
+	if (fd_r[1] != -1) {
+		close(fd_r[1]);
+	}
+	fd_r[1] = fd_l[1];
+	fd_l[1] = -1;
+}
+
+static struct expr *skip(struct expr *e) {
+	struct expr *tmp = e;
+	while (tmp->next 
+		&& tmp->next->type != EXPR_TYPE_AND 
+		&& tmp->next->type != EXPR_TYPE_OR) {
+		tmp = tmp->next;
+	}
+	return tmp;
+}
+
+// returns the first command of the pipeline to run after the operator op,
+// status is of the last pipeline which has run, NULL if there is none
+static struct expr *next_pipeline(struct expr *op, int status) {
+	while (op != NULL) {
+		if ((op->type == EXPR_TYPE_AND) == (status == 0))
+			return op->next;
+		op = skip(op)->next;
+	}
+	return NULL;
+}
+
+static void spawn_attr_init(posix_spawnattr_t *attr) {
+	// SIGPIPE is ignored only by the shell itself
+	posix_spawnattr_init(attr);
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(attr, &sigs);
+	// and SIGCHLD is blocked only for the shell's signalfd
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(attr, &sigs);
+	posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+}
+
+// opens the output redirect in the shell, so its error is not taken for
+// the executable's one, O_NONBLOCK keeps the shell from waiting for the
+// reader of a FIFO
+// returns -1 and prints the error if the file can't be opened, -2 if it is
+// a FIFO nobody reads yet, the child has to open it itself then
+static int open_redirect(const char *path, int flags) {
+	int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		if (errno == ENXIO)
+			return -2;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fcntl(fd, F_SETFL, flags & ~O_CREAT & ~O_TRUNC);
+	return fd;
+}
+
+// starts the command with posix_spawn, glibc does it with clone(CLONE_VM | CLONE_VFORK),
+// so the shell memory is not copied, unlike with fork
+// the executable is taken from the path cache and started with execve
+// in_fd and out_fd become stdin and stdout if not -1, other fds are close-on-exec
+// returns -1 and prints the error if the command can't be started, status
+// is 1 if the output file can't be opened and 127 otherwise
+// path_ns is when the executable has been found
+static pid_t spawn_command(const struct command *cmd, int in_fd, int out_fd,
+						   const struct command_line *line, long long *path_ns,
+						   int *status) {
+	int file_fd = -1;
+	int flags = O_WRONLY | O_CREAT;
+	if (out_fd == -1 && line->out_type != OUTPUT_TYPE_STDOUT) {
+		flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+		file_fd = open_redirect(line->out_file, flags);
+		if (file_fd == -1) {
+			*status = 1;
+			return -1;
+		}
+	}
+	posix_spawnattr_t attr;
+	spawn_attr_init(&attr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	else if (file_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, file_fd, STDOUT_FILENO);
+	else if (file_fd == -2)
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, line->out_file, flags, 0644);
+	char **argv = build_argv(cmd);
 	pid_t pid;
-	struct pq_node *next;
+	// the path comes from the cache, if the file has gone since then it
+	// is looked up once again, ENOENT of a missing script interpreter or
+	// of the redirect keeps the entry
+	int rc = ENOENT;
+	for (int i = 0; i < 2 && rc == ENOENT; ++i) {
+		const char *path = path_resolve(cmd->exe);
+		if (path == NULL)
+			break;
+		*path_ns = stats_now();
+		rc = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+		if (rc != ENOENT || access(path, X_OK) == 0)
+			break;
+		path_forget(cmd->exe);
+	}
+	free(argv);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (file_fd >= 0)
+		close(file_fd);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", cmd->exe, strerror(rc));
+		*status = 127;
+		return -1;
+	}
+	return pid;
+}
+
+// starts a new shell which runs the text like "sh -c", with the stdout
+// into out_fd, it has nothing of this shell but the cwd and the env
+// the trace is not passed, the new shell would truncate the file
+// returns -1 and prints the error if it can't be started
+static pid_t spawn_subshell(const char *text, int out_fd) {
+	posix_spawnattr_t attr;
+	spawn_attr_init(&attr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	size_t count = 0;
+	while (environ[count] != NULL)
+		++count;
+	char **envp = malloc((count + 1) * sizeof(*envp));
+	size_t env_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (strncmp(environ[i], "SHELL_TRACE=", 12) != 0)
+			envp[env_count++] = environ[i];
+	}
+	envp[env_count] = NULL;
+	char *argv[] = {"shell", "-c", (char *)text, NULL};
+	pid_t pid;
+	int rc = posix_spawn(&pid, "/proc/self/exe", &actions, &attr, argv, envp);
+	free(envp);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (rc != 0) {
+		fprintf(stderr, "subshell: %s\n", strerror(rc));
+		return -1;
+	}
+	return pid;
+}
+
+struct writer_task {
+	int fd;
+	// the output redirect, which the thread opens itself, if fd is -1
+	char *path;
+	int flags;
+	struct out_buf out;
 };
 
-struct pqueue {
-	struct pq_node *head;
-	struct pq_node *tail;
+// writes a builtin's output into its pipe or file, so the shell does not
+// block while the reader is slow or a FIFO is not opened by anyone
+// returns the status 1 if the file can't be opened, NULL otherwise
+static void *writer_func(void *arg) {
+	struct writer_task *task = arg;
+	intptr_t status = 0;
+	if (task->fd == -1) {
+		task->fd = open(task->path, task->flags, 0644);
+		if (task->fd < 0) {
+			fprintf(stderr, "%s: %s\n", task->path, strerror(errno));
+			status = 1;
+		}
+	}
+	if (task->fd != -1) {
+		out_buf_write(&task->out, task->fd);
+		close(task->fd);
+	}
+	out_buf_destroy(&task->out);
+	free(task->path);
+	free(task);
+	return (void *)status;
+}
+
+// time the shell's thread has used, a builtin is measured by it, and the
+// wall clock at the same point
+struct thread_usage {
+	struct rusage usage;
+	struct timespec cpu;
+	long long ns;
 };
 
-static struct pq_node *new_node(pid_t pid) {
-	struct pq_node *res = malloc(sizeof(struct pq_node));
-	res->pid = pid;
-	res->next = NULL;
-	return res;
+// the wall clock goes first, so the CPU time is always within the real one
+static void thread_usage_get(struct thread_usage *u) {
+	u->ns = stats_now();
+	getrusage(RUSAGE_THREAD, &u->usage);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &u->cpu);
 }
 
-static struct pqueue *new_pqueue() {
-	struct pqueue *res = malloc(sizeof(struct pqueue));
-	res->head = NULL;
-	res->tail = NULL;
-	return res;
+// the time the thread has used since before, into the usage of the proc,
+// its start and end are the same two points, so its real time has all of
+// the user and sys time and nothing else
+// the CPU clock is exact, while the user and sys times are sampled at
+// the ticks and a short builtin gets a whole tick or nothing, so the
+// clock is split between them in their proportion
+static void thread_usage_since(struct job_proc *proc, const struct thread_usage *before) {
+	struct thread_usage now;
+	getrusage(RUSAGE_THREAD, &now.usage);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now.cpu);
+	now.ns = stats_now();
+	proc->start_ns = before->ns;
+	proc->end_ns = now.ns;
+	struct rusage *usage = &proc->usage;
+	long long cpu_us = ((now.cpu.tv_sec - before->cpu.tv_sec) * 1000000000LL +
+		(now.cpu.tv_nsec - before->cpu.tv_nsec)) / 1000;
+	struct timeval user, sys;
+	timersub(&now.usage.ru_utime, &before->usage.ru_utime, &user);
+	timersub(&now.usage.ru_stime, &before->usage.ru_stime, &sys);
+	long long user_us = user.tv_sec * 1000000LL + user.tv_usec;
+	long long sys_us = sys.tv_sec * 1000000LL + sys.tv_usec;
+	if (user_us + sys_us > 0)
+		user_us = cpu_us * user_us / (user_us + sys_us);
+	else
+		user_us = cpu_us;
+	sys_us = cpu_us - user_us;
+	usage->ru_utime = (struct timeval){user_us / 1000000, user_us % 1000000};
+	usage->ru_stime = (struct timeval){sys_us / 1000000, sys_us % 1000000};
 }
 
-static void push_pqueue(struct pqueue *pq, pid_t pid) {
-	struct pq_node *node = new_node(pid);
-	if (!pq->head) {
-		pq->head = node;
-		pq->tail = node;
-	} else {
-		pq->tail->next = node;
-		pq->tail = pq->tail->next;
+// writes the output of a builtin where its stdout goes
+// returns its process in the job, with the builtin status, or 1 if the
+// output file can't be opened
+// the output of a background line into a file is written by a thread,
+// the shell does not wait for it
+static struct job_proc *finish_builtin(struct job *job, struct out_buf *out, int status,
+						  int out_fd, const struct command_line *line,
+						  const struct thread_usage *usage) {
+	bool is_file = out_fd == -1 && line->out_type != OUTPUT_TYPE_STDOUT;
+	int appending_flag = line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | appending_flag;
+	if ((out_fd != -1 && !out_buf_is_empty(out)) || (is_file && line->is_background)) {
+		struct writer_task *task = malloc(sizeof(*task));
+		task->fd = out_fd != -1 ? fcntl(out_fd, F_DUPFD_CLOEXEC, 0) : -1;
+		task->path = is_file ? strdup(line->out_file) : NULL;
+		task->flags = flags;
+		task->out = *out;
+		struct job_proc *proc = job_add_done(job, status);
+		if (usage != NULL)
+			thread_usage_since(proc, usage);
+		proc->has_writer = true;
+		pthread_create(&proc->writer, NULL, writer_func, task);
+		return proc;
+	}
+	if (is_file) {
+		int file = open(line->out_file, flags, 0644);
+		if (file < 0) {
+			fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+			status = 1;
+		} else {
+			out_buf_write(out, file);
+			close(file);
+		}
+	} else if (out_fd == -1) {
+		out_buf_write(out, STDOUT_FILENO);
 	}
+	out_buf_destroy(out);
+	struct job_proc *proc = job_add_done(job, status);
+	if (usage != NULL)
+		thread_usage_since(proc, usage);
+	return proc;
 }
 
-static int pop_queue(struct pqueue *pq) {
-	int status = -1;
-	if (pq->head) {
-		struct pq_node *tmp = pq->head;
-		pq->head = pq->head->next;
-		waitpid(tmp->pid, &status, 0);
-		if (WIFEXITED(status)) {
-			status = WEXITSTATUS(status);
+// the word of the command with its substitutions as they are written
+static void append_word(struct out_buf *text, const struct command *cmd, uint32_t word,
+						const char *str) {
+	size_t pos = 0;
+	for (uint32_t i = 0; i < cmd->subst_count; ++i) {
+		const struct subst *s = &cmd->substs[i];
+		if (s->word != word)
+			continue;
+		out_buf_append(text, str + pos, s->offset - pos);
+		pos = s->offset;
+		out_buf_append(text, "$(", 2);
+		out_buf_append(text, s->text, strlen(s->text));
+		out_buf_append(text, ")", 1);
+	}
+	out_buf_append(text, str + pos, strlen(str + pos));
+}
+
+// the command line as it is shown by jobs, without the quotes
+static char *line_text(const struct command_line *line) {
+	struct out_buf text = {0};
+	static const char *ops[] = {
+		[EXPR_TYPE_PIPE] = " |",
+		[EXPR_TYPE_AND] = " &&",
+		[EXPR_TYPE_OR] = " ||",
+	};
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND) {
+			out_buf_append(&text, ops[e->type], strlen(ops[e->type]));
+			continue;
+		}
+		if (e != line->head)
+			out_buf_append(&text, " ", 1);
+		append_word(&text, &e->cmd, 0, e->cmd.exe);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			out_buf_append(&text, " ", 1);
+			append_word(&text, &e->cmd, i + 1, e->cmd.args[i]);
 		}
-		free(tmp);
+		if (e == line->head && line->in_type != INPUT_TYPE_STDIN) {
+			const char *op = line->in_type == INPUT_TYPE_FILE ? " < " : " << ";
+			out_buf_append(&text, op, strlen(op));
+			out_buf_append(&text, line->in_file, strlen(line->in_file));
+		}
+	}
+	if (line->out_type != OUTPUT_TYPE_STDOUT) {
+		const char *op = line->out_type == OUTPUT_TYPE_FILE_NEW ? " > " : " >> ";
+		out_buf_append(&text, op, strlen(op));
+		out_buf_append(&text, line->out_file, strlen(line->out_file));
 	}
-	return status;
+	out_buf_append(&text, "", 1);
+	return text.data;
 }
 
-static void free_pqueue(struct pqueue *pq) {
-	while (pq->head) {
-		struct pq_node *tmp = pq->head;
-		pq->head = pq->head->next;
-		free(tmp);
+// opens the input redirect of the line: the file, or a memfd with the
+// here-document, which the child reads as a file without any process
+// to feed it
+// returns -1 and prints the error if it can't be opened
+static int open_input(const struct command_line *line) {
+	if (line->in_type == INPUT_TYPE_FILE) {
+		int fd = open(line->in_file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			fprintf(stderr, "%s: %s\n", line->in_file, strerror(errno));
+		return fd;
+	}
+	int fd = memfd_create("heredoc", MFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "memfd_create: %s\n", strerror(errno));
+		return -1;
 	}
+	for (uint32_t done = 0; done < line->in_size;) {
+		ssize_t rc = write(fd, line->in_data + done, line->in_size - done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			fprintf(stderr, "heredoc: %s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		done += rc;
+	}
+	lseek(fd, 0, SEEK_SET);
+	return fd;
 }
 
-static int wait_pqueue(struct pqueue *pq) {
-	int exitcode = 0;
-	while(pq->head) {
-		exitcode = pop_queue(pq);
+static bool is_interactive;
+
+// of the shell's work and of the foreground lines in the trace, a
+// subshell has the track of its job for both
+static int shell_track = TRACE_TRACK_SHELL;
+static int foreground_track = TRACE_TRACK_FOREGROUND;
+
+// the in-shell commands are measured too, for the stats of the line
+static bool is_accounting;
+
+static struct parser *parser;
+
+// buffer of the input reads
+static char *input_buf;
+
+// frees the shell state before exit, in the shell and in its forks
+static void shell_free(void) {
+	parser_delete(parser);
+	jobs_destroy();
+	stats_close();
+	trace_close();
+	path_clear();
+	free(input_buf);
+}
+
+static int execute_command_line(struct command_line *line, bool is_timed);
+
+static struct expr *start_pipeline(struct expr *e, struct job *job,
+								   struct command_line *line, int out_fd);
+
+static bool needs_subshell(const struct command_line *line);
+
+// Command substitution: the commands of $() run with their stdout into a
+// pipe, the shell reads it into a buffer and puts the output into the
+// words of the command. All the substitutions of a pipeline run at once,
+// the nested ones run before the commands they are in.
+struct subst_run {
+	struct job *job;
+	// read end of the output, -1 after EOF
+	int fd;
+	struct out_buf out;
+};
+
+static bool line_has_chain(const struct command_line *line) {
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+			return true;
 	}
-	free_pqueue(pq);
-	return exitcode;
+	return false;
 }
 
-static void move_pipe(int fd_l[2], int fd_r[2]) {
-	if (fd_r[0] != -1) {
-		close(fd_r[0]);
-	}	
-	fd_r[0] = fd_l[0];
-	fd_l[0] = -1;
+// starts the commands of the substitution
+// a single pipeline runs right in the shell, anything else runs in a new
+// shell: several lines, a chain, which would wait for the builtins'
+// writers while the shell is not reading yet, and cd or exit, which must
+// not change the shell
+// a text which does not parse runs nothing
+static void subst_start(struct subst_run *run, const char *text) {
+	int fds[2];
+	pipe2(fds, O_CLOEXEC);
+	run->fd = fds[0];
+	run->job = job_new();
+	trace_name_job(run->job, text);
+	struct parser *p = parser_new();
+	parser_feed(p, text, strlen(text));
+	parser_feed(p, "\n", 1);
+	struct command_line **lines = NULL;
+	int count = 0;
+	bool has_error = false;
+	struct command_line *line;
+	enum parser_error err;
+	while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE || line != NULL) {
+		if (err != PARSER_ERR_NONE) {
+			printf("Error: %d\n", (int)err);
+			has_error = true;
+			continue;
+		}
+		lines = realloc(lines, (count + 1) * sizeof(*lines));
+		lines[count++] = line;
+	}
+	parser_delete(p);
+	if (!has_error && count == 1 && !lines[0]->is_background &&
+		!line_has_chain(lines[0]) && !needs_subshell(lines[0])) {
+		run->job->line = lines[0];
+		start_pipeline(lines[0]->head, run->job, lines[0], fds[1]);
+	} else {
+		for (int i = 0; i < count; ++i)
+			command_line_delete(lines[i]);
+		if (!has_error && count > 0) {
+			long long start_ns = stats_now();
+			pid_t pid = spawn_subshell(text, fds[1]);
+			if (pid == -1) {
+				job_add_done(run->job, 127);
+			} else {
+				struct job_proc *proc = job_add_pid(run->job, pid);
+				proc->start_ns = start_ns;
+			}
+		}
+	}
+	close(fds[1]);
+	free(lines);
+}
 
-	if (fd_r[1] != -1) {
-		close(fd_r[1]);
+// reads the next part of the output into the buffer, which grows twice
+// when it is full
+static void subst_read(struct subst_run *run) {
+	struct out_buf *out = &run->out;
+	if (out->cap - out->size < 4096) {
+		out->cap = out->cap == 0 ? 4096 : out->cap * 2;
+		out->data = realloc(out->data, out->cap);
+	}
+	ssize_t rc = read(run->fd, out->data + out->size, out->cap - out->size);
+	if (rc > 0) {
+		out->size += rc;
+	} else if (rc == 0 || errno != EINTR) {
+		close(run->fd);
+		run->fd = -1;
 	}
-	fd_r[1] = fd_l[1];
-	fd_l[1] = -1;
 }
 
-static struct expr *skip(struct expr *e) {
-	struct expr *tmp = e;
-	while (tmp->next 
-		&& tmp->next->type != EXPR_TYPE_AND 
-		&& tmp->next->type != EXPR_TYPE_OR) {
-		tmp = tmp->next;
+// reads all the outputs till their ends, then waits for the commands
+static void subst_read_all(struct subst_run *runs, int count) {
+	struct pollfd *fds = malloc((count + 1) * sizeof(*fds));
+	while (true) {
+		jobs_reap();
+		int n = 0;
+		fds[n++] = (struct pollfd){jobs_fd(), POLLIN, 0};
+		for (int i = 0; i < count; ++i) {
+			if (runs[i].fd != -1)
+				fds[n++] = (struct pollfd){runs[i].fd, POLLIN, 0};
+		}
+		if (n == 1)
+			break;
+		if (poll(fds, n, -1) < 0 && errno != EINTR)
+			break;
+		n = 1;
+		for (int i = 0; i < count; ++i) {
+			if (runs[i].fd != -1 && fds[n++].revents != 0)
+				subst_read(&runs[i]);
+		}
+	}
+	free(fds);
+	for (int i = 0; i < count; ++i) {
+		if (runs[i].fd != -1)
+			close(runs[i].fd);
+		job_wait(runs[i].job);
+		job_delete(runs[i].job);
 	}
-	return tmp;
 }
 
-static int execute_command_line(struct command_line *line, struct parser *p) {
-	struct expr *e = line->head;
-	int exitcode = 0;
-	if (e->type == EXPR_TYPE_COMMAND 
-		&& !strncmp(e->cmd.exe, "exit", 6)
-		&& e->next == NULL) {
-			if (e->cmd.arg_count) {
-				exitcode = atoi(e->cmd.args[0]);
+// a word of the expanded command, it is freed with the line
+static void words_push(struct command_line *line, char ***words, uint32_t *count,
+					   struct out_buf *word) {
+	*words = realloc(*words, (*count + 1) * sizeof(**words));
+	char *str = command_line_alloc(line, word->size + 1);
+	if (word->size > 0)
+		memcpy(str, word->data, word->size);
+	str[word->size] = 0;
+	(*words)[(*count)++] = str;
+	word->size = 0;
+}
+
+// puts the output of the substitutions into the words of the command
+// without the trailing newlines, an unquoted output is split into words
+// at the whitespaces, a quoted one is a part of its word
+static void command_expand(struct command_line *line, struct command *cmd,
+						   const struct subst_run *runs) {
+	struct out_buf word = {0};
+	char **words = NULL;
+	uint32_t count = 0;
+	uint32_t k = 0;
+	for (uint32_t w = 0; w <= cmd->arg_count; ++w) {
+		const char *text = w == 0 ? cmd->exe : cmd->args[w - 1];
+		size_t pos = 0;
+		// a word is dropped only if unquoted output has left nothing of it
+		bool is_kept = k == cmd->subst_count || cmd->substs[k].word != w;
+		for (; k < cmd->subst_count && cmd->substs[k].word == w; ++k) {
+			const struct subst *s = &cmd->substs[k];
+			out_buf_append(&word, text + pos, s->offset - pos);
+			pos = s->offset;
+			const struct out_buf *out = &runs[k].out;
+			size_t size = out->size;
+			// the trailing newlines do not split the word, even unquoted
+			while (size > 0 && out->data[size - 1] == '\n')
+				--size;
+			if (s->is_quoted) {
+				out_buf_append(&word, out->data, size);
+				is_kept = true;
+				continue;
 			}
-			parser_delete(p);
-			command_line_delete(line);
-			exit(exitcode);
+			size_t i = 0;
+			while (i < size) {
+				size_t begin = i;
+				while (i < size && !isspace((unsigned char)out->data[i]))
+					++i;
+				out_buf_append(&word, out->data + begin, i - begin);
+				if (i == size)
+					break;
+				if (word.size > 0 || is_kept)
+					words_push(line, &words, &count, &word);
+				is_kept = false;
+				while (i < size && isspace((unsigned char)out->data[i]))
+					++i;
+			}
+		}
+		out_buf_append(&word, text + pos, strlen(text + pos));
+		if (word.size > 0 || is_kept)
+			words_push(line, &words, &count, &word);
+		word.size = 0;
+	}
+	out_buf_destroy(&word);
+	if (count == 0) {
+		// nothing is left of the command, it does nothing like true
+		cmd->exe = "true";
+		cmd->arg_count = 0;
+	} else {
+		cmd->exe = words[0];
+		cmd->arg_count = count - 1;
+		cmd->args = command_line_alloc(line, count * sizeof(*cmd->args));
+		memcpy(cmd->args, words + 1, (count - 1) * sizeof(*cmd->args));
 	}
+	cmd->arg_capacity = cmd->arg_count;
+	cmd->subst_count = 0;
+	free(words);
+}
 
-	struct pqueue *pq = new_pqueue();
+// runs the substitutions of the pipeline which begins with e and puts
+// their output into its commands
+static void expand_pipeline(struct expr *e, struct command_line *line) {
+	int count = 0;
+	for (struct expr *c = e; c != NULL && c->type != EXPR_TYPE_AND &&
+		 c->type != EXPR_TYPE_OR; c = c->next) {
+		if (c->type == EXPR_TYPE_COMMAND)
+			count += c->cmd.subst_count;
+	}
+	if (count == 0)
+		return;
+	struct subst_run *runs = calloc(count, sizeof(*runs));
+	int i = 0;
+	for (struct expr *c = e; c != NULL && c->type != EXPR_TYPE_AND &&
+		 c->type != EXPR_TYPE_OR; c = c->next) {
+		if (c->type != EXPR_TYPE_COMMAND)
+			continue;
+		for (uint32_t k = 0; k < c->cmd.subst_count; ++k)
+			subst_start(&runs[i++], c->cmd.substs[k].text);
+	}
+	subst_read_all(runs, count);
+	i = 0;
+	for (struct expr *c = e; c != NULL && c->type != EXPR_TYPE_AND &&
+		 c->type != EXPR_TYPE_OR; c = c->next) {
+		if (c->type != EXPR_TYPE_COMMAND || c->cmd.subst_count == 0)
+			continue;
+		int n = c->cmd.subst_count;
+		command_expand(line, &c->cmd, runs + i);
+		i += n;
+	}
+	for (i = 0; i < count; ++i)
+		out_buf_destroy(&runs[i].out);
+	free(runs);
+}
+
+// starts the pipeline which begins with e into the job, returns the
+// operator after it, && or ||, or NULL at the end of the line
+// out_fd if not -1 is the stdout of the last command instead of the shell's,
+// unless the line redirects it
+static struct expr *start_pipeline(struct expr *e, struct job *job,
+								   struct command_line *line, int out_fd) {
 	bool in_pipe_left = false;
 	bool in_pipe_right = false;
 	int fd_l[2] = {-1, -1};
 	int fd_r[2] = {-1, -1};
 
-	while (e != NULL) {
+	expand_pipeline(e, line);
+	while (e != NULL && e->type != EXPR_TYPE_AND && e->type != EXPR_TYPE_OR) {
 		if (e->type == EXPR_TYPE_COMMAND) {
+			long long start_ns = stats_now();
+			struct job_proc *proc;
+			// a builtin has its times taken with its usage
+			bool is_measured = false;
 
 			if (!strncmp(e->cmd.exe, "cd", 4)) {
 				chdir(*e->cmd.args);
@@ -140,95 +689,576 @@ static int execute_command_line(struct command_line *line, struct parser *p) {
 			}
 			if (e->next && e->next->type == EXPR_TYPE_PIPE) {
 				in_pipe_left = true;
-				pipe(fd_l);
+				// close-on-exec, so the children get only their own ends
+				pipe2(fd_l, O_CLOEXEC);
+				// fewer wakeups of the reader and the writer on big outputs,
+				// it is fine to stay with the default size if not allowed
+				fcntl(fd_l[1], F_SETPIPE_SZ, PIPE_SIZE);
 			}
+			// the line's own redirect goes before the stdout of the caller
+			int cmd_out = in_pipe_left ? fd_l[1] :
+				line->out_type == OUTPUT_TYPE_STDOUT ? out_fd : -1;
+			int cmd_in = in_pipe_right ? fd_r[0] : -1;
+			// the first command of the line reads its input redirect
+			bool has_input = e == line->head && line->in_type != INPUT_TYPE_STDIN;
+			if (has_input)
+				cmd_in = open_input(line);
 
-			pid_t pid = fork();
-			if (pid == 0) {
-				if (!strncmp(e->cmd.exe, "exit", 6)) {
-					int ret = 0;
-					if (e->cmd.arg_count) {
-						ret = atoi(e->cmd.args[0]);
+			if (has_input && cmd_in == -1) {
+				// the command is not run without its input
+				proc = job_add_done(job, 1);
+			} else if (!strncmp(e->cmd.exe, "exit", 6)) {
+				// exit in a pipeline ends only its own process, which would
+				// do nothing else, so it is just a finished one with the status
+				proc = job_add_done(job, e->cmd.arg_count ? atoi(e->cmd.args[0]) & 0xff : 0);
+			} else {
+				// common builtins run in the shell, they do not read stdin
+				struct out_buf out = {0};
+				struct thread_usage usage;
+				int status;
+				if (is_accounting)
+					thread_usage_get(&usage);
+				// cat of a FIFO or a device in the background would block the
+				// shell in open() or in the copy, the external cat does it
+				bool is_builtin = !line->is_background || strcmp(e->cmd.exe, "cat") != 0;
+				if (is_builtin && builtin_run(&e->cmd, &out, &status)) {
+					proc = finish_builtin(job, &out, status, cmd_out, line,
+										  is_accounting ? &usage : NULL);
+					is_measured = is_accounting;
+				} else {
+					out_buf_destroy(&out);
+					long long path_ns = start_ns;
+					pid_t pid = spawn_command(&e->cmd, cmd_in, cmd_out, line, &path_ns,
+											  &status);
+					if (pid == -1) {
+						proc = job_add_done(job, status);
+					} else {
+						// posix_spawn() returns when the exec has succeeded
+						proc = job_add_pid(job, pid);
+						proc->path_ns = path_ns;
 					}
-					parser_delete(p);
-					command_line_delete(line);
-					free_pqueue(pq);
-					free(pq);
-					exit(ret);
-				}
-				if (in_pipe_left) {
-					dup2(fd_l[1], STDOUT_FILENO);
-					close(fd_l[0]);
-					close(fd_l[1]);
-				} else if (line->out_type != OUTPUT_TYPE_STDOUT) {
-					int file = -1;
-					int appending_flag = line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
-					file = open(line->out_file, O_RDWR | O_CREAT | O_CLOEXEC | appending_flag, 0644);
-					dup2(file, STDOUT_FILENO);
-					close(file);
 				}
-				if (in_pipe_right) {
-					close(fd_r[1]);
-					dup2(fd_r[0], STDIN_FILENO);
-					close(fd_r[0]);
-				}
-				char **argv = build_argv(&e->cmd);
-				execvp(e->cmd.exe, argv);
-				free(argv);
-			} else {
-				push_pqueue(pq, pid);
 			}
+			if (has_input && cmd_in != -1)
+				close(cmd_in);
+			proc->cmd = &e->cmd;
+			if (!is_measured)
+				proc->start_ns = start_ns;
+			if (proc->is_done)
+				trace_proc(job, proc);
 
 		} else if (e->type == EXPR_TYPE_PIPE) {
 			in_pipe_right = true;
 			in_pipe_left = false;
 			move_pipe(fd_l, fd_r);
-		} else if (e->type == EXPR_TYPE_AND) {
-			move_pipe(fd_l, fd_r);
-			exitcode = wait_pqueue(pq);
-			if (exitcode) {
-				e = skip(e);
-			}
-			in_pipe_left = false;
-			in_pipe_right = false;
-		} else if (e->type == EXPR_TYPE_OR) {
-			move_pipe(fd_l, fd_r);
-			exitcode = wait_pqueue(pq);
-			if (!exitcode) {
-				e = skip(e);
-			}
-			in_pipe_left = false;
-			in_pipe_right = false;
 		}
 		e = e->next;
 	}
+	move_pipe(fd_l, fd_r);
 	move_pipe(fd_r, fd_r);
-	exitcode = wait_pqueue(pq);
-	free(pq);
-	return exitcode;
+	return e;
 }
 
-int main(void) {
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
-	struct parser *p = parser_new();
+// runs the next pipelines of a background chain when the previous one
+// is done, called by the job table
+static void continue_chain(struct job *job) {
+	struct expr *e = job->next_op;
+	while (job->running == 0) {
+		e = next_pipeline(e, job_wait(job));
+		if (e == NULL) {
+			job->on_done = NULL;
+			return;
+		}
+		job_clear(job);
+		e = start_pipeline(e, job, job->line, -1);
+	}
+	job->next_op = e;
+}
+
+// a background line with cd or exit, which change the shell itself,
+// runs in a forked copy of the shell, like a subshell
+static bool needs_subshell(const struct command_line *line) {
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND &&
+			(strcmp(e->cmd.exe, "cd") == 0 || strcmp(e->cmd.exe, "exit") == 0))
+			return true;
+	}
+	return false;
+}
+
+static void print_started(const struct job *job) {
+	if (is_interactive && job->proc_count > 0)
+		fprintf(stderr, "[%d] %d\n", job->id, (int)job->procs[job->proc_count - 1].pid);
+}
+
+// starts the line in the background and adds it to the job table, the
+// shell does not wait for it
+// the first pipeline is started right away, the rest of a && or || chain
+// is run by the job table as the pipelines finish
+static void start_background(struct command_line *line) {
+	struct job *job = job_new();
+	char *text = line_text(line);
+	if (needs_subshell(line)) {
+		fflush(stdout);
+		trace_flush();
+		pid_t pid = fork();
+		if (pid == 0) {
+			free(text);
+			shell_track = job->track;
+			foreground_track = job->track;
+			// the subshell has no jobs of its own yet
+			jobs_destroy();
+			jobs_init();
+			line->is_background = false;
+			int ret = execute_command_line(line, false);
+			shell_free();
+			exit(ret);
+		}
+		job_add_pid(job, pid);
+		command_line_delete(line);
+	} else {
+		job->line = line;
+		job->next_op = start_pipeline(line->head, job, line, -1);
+		// a single pipeline is not a chain, the shell does not wait for
+		// it at the end of the input
+		if (job->next_op != NULL)
+			job->on_done = continue_chain;
+	}
+	job_set_background(job, text);
+	print_started(job);
+}
+
+// "time" before a line prints the stats of its commands, the prefix is
+// removed from the line, returns true if it was there
+static bool strip_time(struct command_line *line) {
+	struct command *cmd = &line->head->cmd;
+	if (line->head->type != EXPR_TYPE_COMMAND || strcmp(cmd->exe, "time") != 0 ||
+		cmd->arg_count == 0)
+		return false;
+	// "time$(x)" is not the prefix
+	if (cmd->subst_count > 0 && cmd->substs[0].word == 0)
+		return false;
+	cmd->exe = cmd->args[0];
+	cmd->args++;
+	cmd->arg_count--;
+	cmd->arg_capacity--;
+	// the substitutions are in the words one closer to the exe now
+	for (uint32_t i = 0; i < cmd->subst_count; ++i)
+		cmd->substs[i].word--;
+	return true;
+}
+
+// prints the stats of a timed line into stderr and logs them, they are
+// destroyed
+static void report_stats(struct line_stats *stats, const struct command_line *line,
+						 int status, bool is_timed) {
+	line_stats_finish(stats);
+	if (is_timed)
+		line_stats_print(stats, stderr);
+	if (stats_is_logged()) {
+		char *text = line_text(line);
+		line_stats_log(stats, text, status);
+		free(text);
+	}
+	line_stats_destroy(stats);
+}
+
+// runs the line and deletes it, returns the status of the last pipeline
+// which has run
+// a timed background line is not measured, it is only run
+static int execute_command_line(struct command_line *line, bool is_timed) {
+	struct expr *e = line->head;
 	int exitcode = 0;
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
-				continue;
+	if (line->is_background) {
+		start_background(line);
+		return 0;
+	}
+	if (e->type == EXPR_TYPE_COMMAND 
+		&& !strncmp(e->cmd.exe, "exit", 6)
+		&& e->next == NULL) {
+			expand_pipeline(e, line);
+			if (e->cmd.arg_count) {
+				exitcode = atoi(e->cmd.args[0]);
 			}
-			exitcode = execute_command_line(line, p);
 			command_line_delete(line);
+			jobs_wait_all(true);
+			shell_free();
+			exit(exitcode);
+	}
+
+	bool is_measured = is_timed || stats_is_logged();
+	struct line_stats stats;
+	if (is_measured)
+		line_stats_start(&stats);
+	is_accounting = is_measured;
+	long long start_ns = stats_now();
+	struct job *job = job_new();
+	// the foreground lines run one after another, they share a track
+	job->track = foreground_track;
+	e = start_pipeline(e, job, line, -1);
+	while (true) {
+		exitcode = job_wait(job);
+		if (is_measured)
+			line_stats_add_job(&stats, job);
+		e = next_pipeline(e, exitcode);
+		if (e == NULL)
+			break;
+		job_clear(job);
+		e = start_pipeline(e, job, line, -1);
+	}
+	job_delete(job);
+	if (is_measured)
+		report_stats(&stats, line, exitcode, is_timed);
+	if (trace_is_on()) {
+		char *text = line_text(line);
+		trace_line_span(shell_track, "run", start_ns, stats_now(), text);
+		free(text);
+	}
+	command_line_delete(line);
+	return exitcode;
+}
+
+// Batch mode, -j N: up to N lines of a script run at once. The stdout of
+// each line goes into its own pipe and is buffered, the buffers are
+// printed in the order of the lines. stderr is not buffered.
+struct batch_line {
+	struct command_line *line;
+	struct job *job;
+	// read end of the line's stdout, -1 after EOF or with a redirect
+	int fd;
+	struct out_buf out;
+	bool is_timed;
+	bool is_measured;
+	struct line_stats stats;
+	struct batch_line *next;
+};
+
+static struct {
+	// in the order of the script
+	struct batch_line *head;
+	struct batch_line *tail;
+	int max_running;
+	// of the last line which has been printed or run
+	int status;
+} batch;
+
+static bool batch_line_is_running(const struct batch_line *b) {
+	return b->fd != -1 || b->job->running > 0;
+}
+
+// a line which depends on the shell state or changes it runs alone,
+// after all the lines before it
+static bool batch_is_barrier(const struct command_line *line) {
+	static const char *names[] = {"cd", "exit", "jobs", "wait", "fg", "hash"};
+	if (line->is_background)
+		return true;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+			return true;
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+			if (strcmp(e->cmd.exe, names[i]) == 0)
+				return true;
 		}
 	}
-	parser_delete(p);
+	return false;
+}
+
+// the line redirects into the file or names it in an argument, as far
+// as the names can be compared
+static bool batch_uses_file(const struct command_line *line, const char *file) {
+	if (line->out_type != OUTPUT_TYPE_STDOUT && strcmp(line->out_file, file) == 0)
+		return true;
+	if (line->in_type == INPUT_TYPE_FILE && strcmp(line->in_file, file) == 0)
+		return true;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			if (strcmp(e->cmd.args[i], file) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+// the line writes a file a running line uses or uses a file a running
+// line writes
+static bool batch_has_conflict(const struct command_line *line) {
+	for (struct batch_line *b = batch.head; b != NULL; b = b->next) {
+		if (!batch_line_is_running(b))
+			continue;
+		if (b->line->out_type != OUTPUT_TYPE_STDOUT &&
+			batch_uses_file(line, b->line->out_file))
+			return true;
+		if (line->out_type != OUTPUT_TYPE_STDOUT &&
+			batch_uses_file(b->line, line->out_file))
+			return true;
+	}
+	return false;
+}
+
+static int batch_running_count(void) {
+	int count = 0;
+	for (struct batch_line *b = batch.head; b != NULL; b = b->next)
+		count += batch_line_is_running(b);
+	return count;
+}
+
+// prints the finished lines at the head
+static void batch_flush(void) {
+	while (batch.head != NULL && !batch_line_is_running(batch.head)) {
+		struct batch_line *b = batch.head;
+		batch.head = b->next;
+		if (batch.head == NULL)
+			batch.tail = NULL;
+		batch.status = job_wait(b->job);
+		if (b->is_measured)
+			line_stats_add_job(&b->stats, b->job);
+		job_delete(b->job);
+		out_buf_write(&b->out, STDOUT_FILENO);
+		out_buf_destroy(&b->out);
+		if (b->is_measured)
+			report_stats(&b->stats, b->line, batch.status, b->is_timed);
+		command_line_delete(b->line);
+		free(b);
+	}
+}
+
+// sleeps until some output or an exit of a child, reads the output
+static void batch_step(void) {
+	int count = 1;
+	for (struct batch_line *b = batch.head; b != NULL; b = b->next)
+		count += b->fd != -1;
+	struct pollfd *fds = malloc(count * sizeof(*fds));
+	fds[0] = (struct pollfd){jobs_fd(), POLLIN, 0};
+	int i = 1;
+	for (struct batch_line *b = batch.head; b != NULL; b = b->next) {
+		if (b->fd != -1)
+			fds[i++] = (struct pollfd){b->fd, POLLIN, 0};
+	}
+	if (poll(fds, count, -1) < 0 && errno != EINTR)
+		count = 0;
+	i = 1;
+	for (struct batch_line *b = batch.head; b != NULL; b = b->next) {
+		if (b->fd == -1 || fds[i++].revents == 0)
+			continue;
+		char buf[4096];
+		ssize_t rc = read(b->fd, buf, sizeof(buf));
+		if (rc > 0) {
+			out_buf_append(&b->out, buf, rc);
+		} else if (rc == 0 || errno != EINTR) {
+			close(b->fd);
+			b->fd = -1;
+		}
+	}
+	free(fds);
+	jobs_reap();
+	batch_flush();
+}
+
+// waits for all the lines and prints them
+static void batch_wait_all(void) {
+	batch_flush();
+	while (batch.head != NULL)
+		batch_step();
+}
+
+// runs the line in batch mode
+static void batch_execute(struct command_line *line, bool is_timed) {
+	if (batch_is_barrier(line)) {
+		batch_wait_all();
+		batch.status = execute_command_line(line, is_timed);
+		return;
+	}
+	while (batch_has_conflict(line) || batch_running_count() >= batch.max_running)
+		batch_step();
+	struct batch_line *b = calloc(1, sizeof(*b));
+	b->line = line;
+	b->job = job_new();
+	if (trace_is_on()) {
+		char *text = line_text(line);
+		trace_name_job(b->job, text);
+		free(text);
+	}
+	b->fd = -1;
+	b->is_timed = is_timed;
+	b->is_measured = is_timed || stats_is_logged();
+	if (b->is_measured)
+		line_stats_start(&b->stats);
+	is_accounting = b->is_measured;
+	int fds[2] = {-1, -1};
+	if (line->out_type == OUTPUT_TYPE_STDOUT) {
+		pipe2(fds, O_CLOEXEC);
+		b->fd = fds[0];
+	}
+	start_pipeline(line->head, b->job, line, fds[1]);
+	if (fds[1] != -1)
+		close(fds[1]);
+	if (batch.tail == NULL)
+		batch.head = b;
+	else
+		batch.tail->next = b;
+	batch.tail = b;
+	batch_flush();
+}
+
+// runs the lines parsed so far, returns the status of the last one
+static int run_parsed_lines(int exitcode) {
+	struct command_line *line = NULL;
+	while (true) {
+		long long start_ns = stats_now();
+		enum parser_error err = parser_pop_next(parser, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (trace_is_on() && line != NULL) {
+			char *text = line_text(line);
+			trace_line_span(shell_track, "parse", start_ns, stats_now(), text);
+			free(text);
+		}
+		if (err != PARSER_ERR_NONE) {
+			// after the output of the lines before
+			if (batch.max_running > 1)
+				batch_wait_all();
+			printf("Error: %d\n", (int)err);
+			continue;
+		}
+		bool is_timed = strip_time(line);
+		if (batch.max_running > 1)
+			batch_execute(line, is_timed);
+		else
+			exitcode = execute_command_line(line, is_timed);
+	}
+	return exitcode;
+}
+
+// smallest and biggest reads of the input, a read which fills the
+// buffer doubles it, so a big script is read in big chunks
+#define READ_SIZE_MIN 4096
+#define READ_SIZE_MAX (1 << 20)
+
+// reads the lines from fd and runs them until EOF
+static int run_input(int fd, int exitcode) {
+	size_t buf_size = READ_SIZE_MIN;
+	input_buf = malloc(buf_size);
+	while (true) {
+		if (is_interactive) {
+			// the finished background jobs are reported before the next line
+			struct out_buf done = {0};
+			jobs_print(&done, true);
+			fwrite(done.data, 1, done.size, stderr);
+			free(done.data);
+		} else {
+			jobs_reap();
+		}
+		// the background chains go on while the shell waits for input
+		struct pollfd fds[2] = {{fd, POLLIN, 0}, {jobs_fd(), POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		if (fds[0].revents == 0)
+			continue;
+		ssize_t rc = read(fd, input_buf, buf_size);
+		if (rc <= 0)
+			break;
+		/* Parsed in place, the parser copies only an incomplete last line. */
+		parser_feed_ref(parser, input_buf, rc);
+		exitcode = run_parsed_lines(exitcode);
+		// all the lines are parsed, the buffer is not referenced anymore
+		if ((size_t)rc == buf_size && buf_size < READ_SIZE_MAX) {
+			buf_size *= 2;
+			free(input_buf);
+			input_buf = malloc(buf_size);
+		}
+	}
+	free(input_buf);
+	input_buf = NULL;
+	return exitcode;
+}
+
+// runs a script file, it is mapped into memory and parsed in place
+// a file which can't be mapped, like a pipe, is read
+static int run_script(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 127;
+	}
+	int exitcode = 0;
+	struct stat st;
+	char *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		exitcode = run_input(fd, exitcode);
+		close(fd);
+		return exitcode;
+	}
+	close(fd);
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	// the parser takes at most 4GB at once
+	const off_t chunk_size = 1 << 30;
+	for (off_t pos = 0; pos < st.st_size; pos += chunk_size) {
+		off_t size = st.st_size - pos < chunk_size ? st.st_size - pos : chunk_size;
+		parser_feed_ref(parser, data + pos, size);
+		exitcode = run_parsed_lines(exitcode);
+	}
+	munmap(data, st.st_size);
+	return exitcode;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-j jobs] [-c command | script]\n", prog);
+	fprintf(stderr, "jobs - number of script lines run at once, 1 by default\n");
+	fprintf(stderr, "command - lines to run instead of a script\n");
+	fprintf(stderr, "script - file with the commands, stdin by default\n");
+}
+
+int main(int argc, char **argv) {
+	batch.max_running = 1;
+	const char *command = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:c:")) != -1) {
+		switch (opt) {
+		case 'j':
+			batch.max_running = atoi(optarg);
+			break;
+		case 'c':
+			command = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (batch.max_running < 1 || argc - optind > (command == NULL ? 1 : 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+	parser = parser_new();
+	int exitcode = 0;
+	// builtins write into pipes themselves, a closed pipe is just an error
+	signal(SIGPIPE, SIG_IGN);
+	jobs_init();
+	stats_open(getenv("SHELL_STATS"));
+	trace_open(getenv("SHELL_TRACE"));
+	if (command != NULL) {
+		// a substitution which can't run in the shell itself comes here
+		parser_feed(parser, command, strlen(command));
+		parser_feed(parser, "\n", 1);
+		exitcode = run_parsed_lines(exitcode);
+	} else if (optind < argc) {
+		exitcode = run_script(argv[optind]);
+	} else {
+		is_interactive = isatty(STDIN_FILENO);
+		exitcode = run_input(STDIN_FILENO, exitcode);
+	}
+	if (batch.max_running > 1) {
+		batch_wait_all();
+		exitcode = batch.status;
+	}
+	// the rest of the background chains has no one else to run it
+	jobs_wait_all(true);
+	shell_free();
 	return exitcode;
 }
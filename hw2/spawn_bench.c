@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Commands per second of fork + exec and of posix_spawn, like the shell
+// launches them, while the process has a heap of different sizes. fork
+// copies the page tables of the whole heap, posix_spawn does not.
+// The shells given after the sizes, like ./main and a build of the
+// baseline, run the same number of /bin/true lines, after a line of the
+// heap size has grown their parser buffer. true would be a builtin. The
+// line is a cd, which fails in the shell itself, an external command
+// can't take an argument that long.
+// The baseline parser is quadratic in the line length, it takes seconds
+// already to read a line of a few MB.
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t launch_fork(char **argv) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t launch_spawn(char **argv) {
+	pid_t pid;
+	if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+		return -1;
+	return pid;
+}
+
+static void write_all(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc <= 0) {
+			perror("write");
+			exit(1);
+		}
+		data += rc;
+		size -= rc;
+	}
+}
+
+// reads the shell's stdout until the line is printed
+static void wait_line(FILE *out, const char *line) {
+	char buf[64];
+	while (fgets(buf, sizeof(buf), out) != NULL) {
+		if (strcmp(buf, line) == 0)
+			return;
+	}
+	fprintf(stderr, "The shell has exited before printing %s", line);
+	exit(1);
+}
+
+static double bench_shell(const char *shell, size_t heap_size, int count) {
+	int in[2], out[2];
+	if (pipe(in) != 0 || pipe(out) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addclose(&actions, in[1]);
+	posix_spawn_file_actions_addclose(&actions, out[0]);
+	char *argv[] = {(char *)shell, NULL};
+	pid_t pid;
+	int rc = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) {
+		fprintf(stderr, "Can't start %s: %s\n", shell, strerror(rc));
+		exit(1);
+	}
+	close(in[0]);
+	close(out[1]);
+	FILE *shell_out = fdopen(out[0], "r");
+	// the shell keeps its buffers as big as the longest line
+	const char *head = "cd x";
+	const char *tail = "\necho ready\n";
+	size_t size = strlen(head) + heap_size + strlen(tail);
+	char *text = malloc(size > (size_t)count * 10 + 10 ? size : (size_t)count * 10 + 10);
+	memcpy(text, head, strlen(head));
+	memset(text + strlen(head), 'x', heap_size);
+	memcpy(text + strlen(head) + heap_size, tail, strlen(tail));
+	write_all(in[1], text, size);
+	wait_line(shell_out, "ready\n");
+
+	size = 0;
+	for (int i = 0; i < count; ++i)
+		size += sprintf(text + size, "/bin/true\n");
+	size += sprintf(text + size, "echo done\n");
+	double start = now();
+	write_all(in[1], text, size);
+	wait_line(shell_out, "done\n");
+	double rate = count / (now() - start);
+	free(text);
+	close(in[1]);
+	fclose(shell_out);
+	waitpid(pid, NULL, 0);
+	return rate;
+}
+
+static double bench(pid_t (*launch)(char **), char **argv, int count) {
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		pid_t pid = launch(argv);
+		if (pid == -1) {
+			fprintf(stderr, "Can't start %s\n", argv[0]);
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return count / (now() - start);
+}
+
+int main(int argc, char **argv) {
+	int count = argc > 1 ? atoi(argv[1]) : 500;
+	const char *sizes = argc > 2 ? argv[2] : "0,64,256,1024";
+	char *cmd[] = {"/bin/true", NULL};
+	if (count <= 0) {
+		fprintf(stderr, "Usage: %s [commands count] [heap sizes, MB, comma separated] "
+				"[shells]\n", argv[0]);
+		return 1;
+	}
+	char **shells = argv + (argc > 3 ? 3 : argc);
+	printf("%10s %14s %14s", "heap, MB", "fork, cmd/s", "spawn, cmd/s");
+	for (char **shell = shells; *shell != NULL; ++shell) {
+		const char *name = strrchr(*shell, '/');
+		printf(" %14s", name != NULL ? name + 1 : *shell);
+	}
+	printf("\n");
+	const char *pos = sizes;
+	while (*pos != 0) {
+		char *next;
+		size_t mb = strtoull(pos, &next, 10);
+		// the heap is touched, so its pages are really mapped, and made of
+		// small pages, like a heap of many allocations
+		char *heap = NULL;
+		if (mb != 0) {
+			heap = mmap(NULL, mb << 20, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (heap == MAP_FAILED) {
+				fprintf(stderr, "Can't allocate %zu MB\n", mb);
+				return 1;
+			}
+			madvise(heap, mb << 20, MADV_NOHUGEPAGE);
+			memset(heap, 1, mb << 20);
+		}
+		double fork_rate = bench(launch_fork, cmd, count);
+		double spawn_rate = bench(launch_spawn, cmd, count);
+		printf("%10zu %14.0f %14.0f", mb, fork_rate, spawn_rate);
+		for (char **shell = shells; *shell != NULL; ++shell)
+			printf(" %14.0f", bench_shell(*shell, mb << 20, count));
+		printf("\n");
+		if (heap != NULL)
+			munmap(heap, mb << 20);
+		pos = *next == ',' ? next + 1 : next;
+	}
+	return 0;
+}
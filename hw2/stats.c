@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "parser.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static FILE *log_file;
+
+long long stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_open(const char *path) {
+	if (path == NULL || *path == 0)
+		return;
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0 || (log_file = fdopen(fd, "a")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	// a record goes out in one write(), so the records of the subshells
+	// which append to the same file do not mix
+	setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+}
+
+void stats_close(void) {
+	if (log_file != NULL)
+		fclose(log_file);
+	log_file = NULL;
+}
+
+bool stats_is_logged(void) {
+	return log_file != NULL;
+}
+
+void line_stats_start(struct line_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->start_ns = stats_now();
+}
+
+void line_stats_add_job(struct line_stats *stats, const struct job *job) {
+	for (int i = 0; i < job->proc_count; ++i) {
+		const struct job_proc *proc = &job->procs[i];
+		if (stats->count == stats->capacity) {
+			stats->capacity = stats->capacity == 0 ? 4 : stats->capacity * 2;
+			stats->stages = realloc(stats->stages, stats->capacity * sizeof(*stats->stages));
+		}
+		struct stage_stats *stage = &stats->stages[stats->count++];
+		stage->cmd = proc->cmd;
+		stage->pid = proc->pid;
+		stage->status = proc->status;
+		stage->start_ns = proc->start_ns;
+		stage->end_ns = proc->end_ns;
+		stage->usage = proc->usage;
+	}
+}
+
+void line_stats_finish(struct line_stats *stats) {
+	stats->end_ns = stats->count == 0 ? stats_now() : stats->start_ns;
+	for (int i = 0; i < stats->count; ++i) {
+		if (stats->stages[i].end_ns > stats->end_ns)
+			stats->end_ns = stats->stages[i].end_ns;
+	}
+}
+
+static long long timeval_us(const struct timeval *tv) {
+	return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+// the sums of the commands' times and the biggest RSS among them
+static void line_stats_total(const struct line_stats *stats, long long *user_us,
+							 long long *sys_us, long *max_rss_kb) {
+	*user_us = 0;
+	*sys_us = 0;
+	*max_rss_kb = 0;
+	for (int i = 0; i < stats->count; ++i) {
+		const struct stage_stats *stage = &stats->stages[i];
+		*user_us += timeval_us(&stage->usage.ru_utime);
+		*sys_us += timeval_us(&stage->usage.ru_stime);
+		if (stage->pid != -1 && stage->usage.ru_maxrss > *max_rss_kb)
+			*max_rss_kb = stage->usage.ru_maxrss;
+	}
+}
+
+static void print_row(FILE *out, long long real_ns, long long user_us,
+					  long long sys_us, long max_rss_kb) {
+	fprintf(out, "%9.3f %9.3f %9.3f ", real_ns / 1e9, user_us / 1e6, sys_us / 1e6);
+	if (max_rss_kb > 0)
+		fprintf(out, "%11ldK  ", max_rss_kb);
+	else
+		fprintf(out, "%12s  ", "-");
+}
+
+void line_stats_print(const struct line_stats *stats, FILE *out) {
+	fprintf(out, "%9s %9s %9s %12s  %s\n", "real", "user", "sys", "max RSS", "command");
+	for (int i = 0; i < stats->count; ++i) {
+		const struct stage_stats *stage = &stats->stages[i];
+		print_row(out, stage->end_ns - stage->start_ns, timeval_us(&stage->usage.ru_utime),
+				  timeval_us(&stage->usage.ru_stime),
+				  stage->pid == -1 ? 0 : stage->usage.ru_maxrss);
+		fputs(stage->cmd->exe, out);
+		for (uint32_t j = 0; j < stage->cmd->arg_count; ++j)
+			fprintf(out, " %s", stage->cmd->args[j]);
+		fputc('\n', out);
+	}
+	long long user_us, sys_us;
+	long max_rss_kb;
+	line_stats_total(stats, &user_us, &sys_us, &max_rss_kb);
+	print_row(out, stats->end_ns - stats->start_ns, user_us, sys_us, max_rss_kb);
+	fprintf(out, "total\n");
+}
+
+void json_chars(FILE *out, const char *str) {
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+}
+
+void json_command(FILE *out, const struct command *cmd) {
+	fputc('"', out);
+	json_chars(out, cmd->exe);
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		fputc(' ', out);
+		json_chars(out, cmd->args[i]);
+	}
+	fputc('"', out);
+}
+
+void line_stats_log(const struct line_stats *stats, const char *text, int status) {
+	if (log_file == NULL)
+		return;
+	long long user_us, sys_us;
+	long max_rss_kb;
+	line_stats_total(stats, &user_us, &sys_us, &max_rss_kb);
+	fprintf(log_file, "{\"line\": \"");
+	json_chars(log_file, text);
+	fprintf(log_file, "\", \"status\": %d, \"real_us\": %lld, \"user_us\": %lld, "
+		"\"sys_us\": %lld, \"max_rss_kb\": %ld, \"stages\": [", status,
+		(stats->end_ns - stats->start_ns) / 1000, user_us, sys_us, max_rss_kb);
+	for (int i = 0; i < stats->count; ++i) {
+		const struct stage_stats *stage = &stats->stages[i];
+		fprintf(log_file, "%s{\"command\": ", i == 0 ? "" : ", ");
+		json_command(log_file, stage->cmd);
+		// an in-shell command has neither a pid nor an RSS
+		if (stage->pid == -1)
+			fprintf(log_file, ", \"pid\": null");
+		else
+			fprintf(log_file, ", \"pid\": %d", (int)stage->pid);
+		fprintf(log_file, ", \"status\": %d, \"real_us\": %lld, \"user_us\": %lld, "
+			"\"sys_us\": %lld, ", stage->status, (stage->end_ns - stage->start_ns) / 1000,
+			timeval_us(&stage->usage.ru_utime), timeval_us(&stage->usage.ru_stime));
+		if (stage->pid == -1)
+			fprintf(log_file, "\"max_rss_kb\": null}");
+		else
+			fprintf(log_file, "\"max_rss_kb\": %ld}", stage->usage.ru_maxrss);
+	}
+	fprintf(log_file, "]}\n");
+	fflush(log_file);
+}
+
+void line_stats_destroy(struct line_stats *stats) {
+	free(stats->stages);
+	stats->stages = NULL;
+	stats->count = 0;
+	stats->capacity = 0;
+}
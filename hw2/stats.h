@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+// Resources used by a command line and by each of its commands. The
+// children are reaped with wait4(), which gives their rusage for free,
+// an in-shell command is measured with getrusage(RUSAGE_THREAD) around
+// it, without the thread which writes its output into a pipe, and has
+// no RSS of its own.
+// "time cmd | cmd" prints them into stderr, and if SHELL_STATS names a
+// file, every line appends them to it as one JSON line.
+
+struct command;
+struct job;
+
+// one command of the line
+struct stage_stats {
+	// points into the line, the stats must not outlive it
+	const struct command *cmd;
+	pid_t pid; // -1 for an in-shell command
+	int status;
+	long long start_ns;
+	long long end_ns;
+	struct rusage usage;
+};
+
+struct line_stats {
+	long long start_ns;
+	long long end_ns;
+	struct stage_stats *stages;
+	int count;
+	int capacity;
+};
+
+// monotonic time, ns
+long long stats_now(void);
+
+// opens the file for the JSON lines, does nothing if path is NULL
+void stats_open(const char *path);
+
+// closes the JSON lines file
+void stats_close(void);
+
+// every line has to be measured, not only the timed ones
+bool stats_is_logged(void);
+
+void line_stats_start(struct line_stats *stats);
+
+// adds the commands of the job's current pipeline, the job must be waited
+void line_stats_add_job(struct line_stats *stats, const struct job *job);
+
+// the line ends when its last command has ended
+void line_stats_finish(struct line_stats *stats);
+
+// prints a table of the commands and the total into out
+void line_stats_print(const struct line_stats *stats, FILE *out);
+
+// appends the stats to the JSON lines file if it is open
+void line_stats_log(const struct line_stats *stats, const char *text, int status);
+
+void line_stats_destroy(struct line_stats *stats);
+
+// the characters of str escaped for a JSON string, without the quotes
+void json_chars(FILE *out, const char *str);
+
+// the command with its arguments as a JSON string
+void json_command(FILE *out, const struct command *cmd);
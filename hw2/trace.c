@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "parser.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct {
+	FILE *file;
+	// the shell which has opened the file
+	pid_t owner;
+	// the timestamps are from the start of the trace
+	long long start_ns;
+	bool is_first;
+} trace;
+
+// starts the next event, they are separated by commas
+static void event_begin(void) {
+	fputs(trace.is_first ? "\n" : ",\n", trace.file);
+	trace.is_first = false;
+}
+
+// a background job is named like in jobs, with its number
+static void name_track(int track, int id, const char *name) {
+	event_begin();
+	fprintf(trace.file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+		"\"args\": {\"name\": \"", track);
+	if (id != 0)
+		fprintf(trace.file, "[%d] ", id);
+	json_chars(trace.file, name);
+	fputs("\"}}", trace.file);
+}
+
+void trace_open(const char *path) {
+	if (path == NULL || *path == 0)
+		return;
+	trace.file = fopen(path, "we");
+	if (trace.file == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+	trace.owner = getpid();
+	trace.start_ns = stats_now();
+	trace.is_first = true;
+	fputc('[', trace.file);
+	name_track(TRACE_TRACK_SHELL, 0, "shell");
+	name_track(TRACE_TRACK_FOREGROUND, 0, "foreground");
+}
+
+void trace_close(void) {
+	if (trace.file == NULL)
+		return;
+	if (getpid() == trace.owner)
+		fputs("\n]\n", trace.file);
+	fclose(trace.file);
+	trace.file = NULL;
+}
+
+bool trace_is_on(void) {
+	return trace.file != NULL;
+}
+
+void trace_flush(void) {
+	if (trace.file != NULL)
+		fflush(trace.file);
+}
+
+void trace_name_job(const struct job *job, const char *name) {
+	if (trace.file != NULL)
+		name_track(job->track, job->id, name);
+}
+
+// a complete event, its details are written by the caller and closed
+// with "}}"
+static void span_begin(const char *name, const char *cat, int track, int row,
+					   long long start_ns, long long end_ns) {
+	event_begin();
+	fputs("{\"name\": \"", trace.file);
+	json_chars(trace.file, name);
+	fprintf(trace.file, "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+		"\"pid\": %d, \"tid\": %d, \"args\": {", cat, (start_ns - trace.start_ns) / 1e3,
+		(end_ns - start_ns) / 1e3, track, row);
+}
+
+void trace_line_span(int track, const char *name, long long start_ns, long long end_ns,
+					 const char *line) {
+	if (trace.file == NULL)
+		return;
+	span_begin(name, name, track, 0, start_ns, end_ns);
+	fputs("\"line\": \"", trace.file);
+	json_chars(trace.file, line);
+	fputs("\"}}", trace.file);
+}
+
+void trace_proc(const struct job *job, const struct job_proc *proc) {
+	if (trace.file == NULL)
+		return;
+	// a background line with cd or exit is a whole forked shell
+	const char *name = proc->cmd != NULL ? proc->cmd->exe : "subshell";
+	if (proc->pid == -1) {
+		span_begin(name, "builtin", job->track, 0, proc->start_ns, proc->end_ns);
+	} else {
+		// a subshell has neither the path lookup nor the spawn
+		if (proc->path_ns > proc->start_ns) {
+			span_begin("path", "spawn", job->track, proc->pid, proc->start_ns, proc->path_ns);
+			fputs("}}", trace.file);
+		}
+		if (proc->exec_ns > proc->path_ns) {
+			span_begin("spawn", "spawn", job->track, proc->pid, proc->path_ns, proc->exec_ns);
+			fputs("}}", trace.file);
+		}
+		span_begin(name, "run", job->track, proc->pid, proc->exec_ns, proc->end_ns);
+		fprintf(trace.file, "\"pid\": %d, ", (int)proc->pid);
+	}
+	fprintf(trace.file, "\"status\": %d", proc->status);
+	if (proc->cmd != NULL) {
+		fputs(", \"command\": ", trace.file);
+		json_command(trace.file, proc->cmd);
+	}
+	fputs("}}", trace.file);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Timeline of the shell in the Chrome trace event format, it is written
+// into the file SHELL_TRACE names and opens in chrome://tracing or
+// ui.perfetto.dev. Every job is a track ("process" of the format), the
+// shell's own track has the parsing and the run of each line. In a job
+// each child has a row ("thread") with the path lookup, the spawn up to
+// the successful exec and the run up to the exit, the in-shell commands
+// are on the row 0.
+
+struct job;
+struct job_proc;
+
+// the shell's own track, and the one of all the foreground lines, the
+// other jobs get their own
+#define TRACE_TRACK_SHELL 0
+#define TRACE_TRACK_FOREGROUND 1
+
+// opens the trace file, does nothing if path is NULL
+void trace_open(const char *path);
+
+// ends the trace, only the shell which has opened the file finishes it,
+// the forks just flush their events
+void trace_close(void);
+
+bool trace_is_on(void);
+
+// writes out the buffered events, before a fork
+void trace_flush(void);
+
+// names the track of the job
+void trace_name_job(const struct job *job, const char *name);
+
+// a span of the shell's work on the line, on the row 0 of the track
+void trace_line_span(int track, const char *name, long long start_ns, long long end_ns,
+					 const char *line);
+
+// the spans of a finished command of the job
+void trace_proc(const struct job *job, const struct job_proc *proc);